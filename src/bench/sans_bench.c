@@ -0,0 +1,429 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "sans.h"
+#include "rudp.h"
+
+/*
+ *  sans-bench - RUDP vs TCP throughput and latency over loopback
+ *
+ *  Each run opens one connection with sans_connect()/sans_accept() and
+ *  streams `count` messages from a client to a server thread in the same
+ *  process.  Every message carries its send time, so the server records
+ *  one-way latency; goodput is payload bytes over the time from the first
+ *  send to the last receive.  The sweep covers every combination of
+ *  payload size, window size and loss rate asked for.
+ *
+ *  RUDP runs use sans_send_pkt()/sans_recv_pkt(), SANS_OPT_WINDOW_MAX for
+ *  the window and SANS_OPT_IMPAIR on the sender for loss.  TCP runs move
+ *  the same messages with send()/recv() on the sockets sans_connect() and
+ *  sans_accept() return, with SO_SNDBUF/SO_RCVBUF standing in for the
+ *  window; loopback TCP cannot be impaired, so lossy TCP runs are skipped.
+ */
+
+#define MSG_HDR_LEN 16   /* sequence number and send timestamp */
+#define RECV_TIMEOUT_MS 1000
+
+enum { PROTO_RUDP, PROTO_TCP };
+enum { FMT_TABLE, FMT_CSV, FMT_JSON };
+
+struct bench_run {
+  int proto;
+  int size;
+  int window;
+  double loss;
+  int count;
+  int port;
+};
+
+struct bench_result {
+  int ok;
+  int received;
+  double secs;
+  double goodput_mbps;
+  double p50_us, p99_us, p999_us;
+  double retrans_ratio;   /* resends per data packet sent, -1 if unknown */
+  double cpu_s_per_gb;    /* user + system time of the whole process */
+};
+
+struct server_arg {
+  const struct bench_run* run;
+  uint64_t* latency_ns;
+  int received;
+  uint64_t last_ns;
+  int failed;
+};
+
+static const char* host = "127.0.0.1";
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000UL + (uint64_t)ts.tv_nsec;
+}
+
+static double cpu_seconds(void) {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+         (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static const char* proto_name(int proto) {
+  return proto == PROTO_TCP ? "tcp" : "rudp";
+}
+
+/* Read exactly `len` bytes from a TCP stream, -1 on error or EOF. */
+static int recv_exact(int fd, char* buf, int len) {
+  int got = 0;
+  while (got < len) {
+    ssize_t n = recv(fd, buf + got, len - got, 0);
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR) continue;
+      return -1;
+    }
+    got += (int)n;
+  }
+  return got;
+}
+
+static int send_all(int fd, const char* buf, int len) {
+  int sent = 0;
+  while (sent < len) {
+    ssize_t n = send(fd, buf + sent, len - sent, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    sent += (int)n;
+  }
+  return sent;
+}
+
+static void set_tcp_window(int fd, int window) {
+  if (window <= 0) return;
+  setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &window, sizeof(window));
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &window, sizeof(window));
+}
+
+static void* server(void* p) {
+  struct server_arg* arg = p;
+  const struct bench_run* run = arg->run;
+  char* buf = malloc(run->size);
+  int sock = sans_accept(host, run->port, run->proto == PROTO_TCP ? IPPROTO_TCP : IPPROTO_RUDP);
+  if (!buf || sock < 0) {
+    arg->failed = 1;
+    free(buf);
+    return NULL;
+  }
+
+  if (run->proto == PROTO_TCP) {
+    set_tcp_window(sock, run->window);
+    struct timeval tv = { .tv_sec = RECV_TIMEOUT_MS / 1000 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  }
+
+  while (arg->received < run->count) {
+    int n = run->proto == PROTO_TCP ? recv_exact(sock, buf, run->size)
+                                    : sans_recv_pkt(sock, buf, run->size);
+    if (n < 0) {
+      arg->failed = 1;
+      break;
+    }
+    if (n < MSG_HDR_LEN) continue;
+
+    uint64_t sent_ns;
+    memcpy(&sent_ns, buf + 8, sizeof(sent_ns));
+    arg->last_ns = now_ns();
+    arg->latency_ns[arg->received++] = arg->last_ns - sent_ns;
+  }
+
+  if (run->proto == PROTO_TCP)
+    close(sock);
+  else
+    sans_disconnect(sock);
+  free(buf);
+  return NULL;
+}
+
+/* RUDP's sans_connect() gives up after its SYN retries; TCP's fails at once
+   if the server thread has not started listening yet. */
+static int connect_to_server(const struct bench_run* run) {
+  for (int tries = 0; tries < 50; tries++) {
+    int sock = sans_connect(host, run->port, run->proto == PROTO_TCP ? IPPROTO_TCP : IPPROTO_RUDP);
+    if (sock >= 0) return sock;
+    usleep(20000);
+  }
+  return -1;
+}
+
+/* TCP segments sent and retransmitted host-wide, from /proc/net/snmp. */
+static int tcp_segments(uint64_t* out, uint64_t* retrans) {
+  FILE* f = fopen("/proc/net/snmp", "r");
+  if (!f) return -1;
+  char names[1024], values[1024];
+  int rc = -1;
+  while (fgets(names, sizeof(names), f) && fgets(values, sizeof(values), f)) {
+    if (strncmp(names, "Tcp:", 4) != 0) continue;
+    char* nsave = NULL;
+    char* vsave = NULL;
+    char* name = strtok_r(names, " \n", &nsave);
+    char* value = strtok_r(values, " \n", &vsave);
+    while (name && value) {
+      if (strcmp(name, "OutSegs") == 0) *out = strtoull(value, NULL, 10);
+      else if (strcmp(name, "RetransSegs") == 0) *retrans = strtoull(value, NULL, 10);
+      name = strtok_r(NULL, " \n", &nsave);
+      value = strtok_r(NULL, " \n", &vsave);
+    }
+    rc = 0;
+    break;
+  }
+  fclose(f);
+  return rc;
+}
+
+static int compare_u64(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+/* nearest-rank percentile of a sorted sample, in microseconds */
+static double percentile(const uint64_t* sorted, int n, double q) {
+  if (n == 0) return 0;
+  int rank = (int)(q * n + 0.999999);
+  if (rank < 1) rank = 1;
+  if (rank > n) rank = n;
+  return sorted[rank - 1] / 1000.0;
+}
+
+static void bench(const struct bench_run* run, struct bench_result* res) {
+  memset(res, 0, sizeof(*res));
+  res->retrans_ratio = -1;
+
+  struct server_arg arg = { .run = run };
+  arg.latency_ns = calloc(run->count, sizeof(*arg.latency_ns));
+  char* buf = calloc(1, run->size);
+  if (!arg.latency_ns || !buf) {
+    free(arg.latency_ns);
+    free(buf);
+    return;
+  }
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, server, &arg) != 0) {
+    free(arg.latency_ns);
+    free(buf);
+    return;
+  }
+  usleep(50000); /* let the server bind */
+
+  int sock = connect_to_server(run);
+  uint64_t tcp_out = 0, tcp_retrans = 0, tcp_out_end = 0, tcp_retrans_end = 0;
+  double cpu_start = cpu_seconds();
+  uint64_t start = now_ns();
+  int failed = sock < 0;
+
+  if (!failed && run->proto == PROTO_TCP) {
+    set_tcp_window(sock, run->window);
+    tcp_segments(&tcp_out, &tcp_retrans);
+  }
+  else if (!failed) {
+    if (run->window > 0)
+      sans_setopt(sock, SANS_OPT_WINDOW_MAX, &run->window, sizeof(run->window));
+    if (run->loss > 0) {
+      struct sans_impair im = { .loss = run->loss, .seed = (unsigned int)run->port };
+      sans_setopt(sock, SANS_OPT_IMPAIR, &im, sizeof(im));
+    }
+  }
+
+  for (int i = 0; !failed && i < run->count; i++) {
+    uint64_t seq = (uint64_t)i, stamp = now_ns();
+    memcpy(buf, &seq, sizeof(seq));
+    memcpy(buf + 8, &stamp, sizeof(stamp));
+    int n = run->proto == PROTO_TCP ? send_all(sock, buf, run->size)
+                                    : sans_send_pkt(sock, buf, run->size);
+    if (n < 0) failed = 1;
+  }
+
+  if (sock >= 0 && run->proto == PROTO_RUDP) {
+    /* wait for the last ACK so every resend is counted */
+    struct rudp_conn* conn = rudp_conn_lookup(sock);
+    struct sans_stats stats;
+    if (conn) {
+      drain_window(conn);
+      rudp_conn_put(conn);
+    }
+    if (sans_get_stats(sock, &stats) == 0 && stats.packets_sent)
+      res->retrans_ratio = (double)stats.retransmits / stats.packets_sent;
+  }
+  pthread_join(thread, NULL);
+  double cpu = cpu_seconds() - cpu_start;
+
+  if (sock >= 0 && run->proto == PROTO_TCP) {
+    if (tcp_segments(&tcp_out_end, &tcp_retrans_end) == 0 && tcp_out_end > tcp_out)
+      res->retrans_ratio = (double)(tcp_retrans_end - tcp_retrans) / (tcp_out_end - tcp_out);
+    close(sock);
+  }
+  else if (sock >= 0) {
+    sans_disconnect(sock);
+  }
+
+  res->ok = !failed && !arg.failed && arg.received == run->count;
+  res->received = arg.received;
+  if (arg.received > 0 && arg.last_ns > start) {
+    double bytes = (double)arg.received * run->size;
+    res->secs = (arg.last_ns - start) / 1e9;
+    res->goodput_mbps = bytes * 8 / res->secs / 1e6;
+    res->cpu_s_per_gb = cpu / (bytes / 1e9);
+    qsort(arg.latency_ns, arg.received, sizeof(*arg.latency_ns), compare_u64);
+    res->p50_us = percentile(arg.latency_ns, arg.received, 0.50);
+    res->p99_us = percentile(arg.latency_ns, arg.received, 0.99);
+    res->p999_us = percentile(arg.latency_ns, arg.received, 0.999);
+  }
+  free(arg.latency_ns);
+  free(buf);
+}
+
+static void print_header(int format) {
+  if (format == FMT_CSV)
+    printf("proto,size,window,loss,count,ok,secs,goodput_mbps,p50_us,p99_us,p999_us,retrans_ratio,cpu_s_per_gb\n");
+  else if (format == FMT_TABLE)
+    printf("%-5s %6s %9s %6s %8s %10s %10s %10s %10s %9s %9s\n", "proto", "size", "window",
+           "loss", "count", "Mbit/s", "p50 us", "p99 us", "p999 us", "retrans", "cpu s/GB");
+}
+
+static void print_result(int format, const struct bench_run* run, const struct bench_result* res) {
+  if (format == FMT_CSV) {
+    printf("%s,%d,%d,%g,%d,%d,%.6f,%.3f,%.1f,%.1f,%.1f,%.6f,%.3f\n", proto_name(run->proto),
+           run->size, run->window, run->loss, run->count, res->ok, res->secs, res->goodput_mbps,
+           res->p50_us, res->p99_us, res->p999_us, res->retrans_ratio, res->cpu_s_per_gb);
+  }
+  else if (format == FMT_JSON) {
+    printf("{\"proto\":\"%s\",\"size\":%d,\"window\":%d,\"loss\":%g,\"count\":%d,\"ok\":%s,"
+           "\"received\":%d,\"secs\":%.6f,\"goodput_mbps\":%.3f,\"p50_us\":%.1f,\"p99_us\":%.1f,"
+           "\"p999_us\":%.1f,\"retrans_ratio\":%.6f,\"cpu_s_per_gb\":%.3f}\n",
+           proto_name(run->proto), run->size, run->window, run->loss, run->count,
+           res->ok ? "true" : "false", res->received, res->secs, res->goodput_mbps, res->p50_us,
+           res->p99_us, res->p999_us, res->retrans_ratio, res->cpu_s_per_gb);
+  }
+  else {
+    printf("%-5s %6d %9d %6g %8d %10.1f %10.1f %10.1f %10.1f %9.4f %9.2f%s\n",
+           proto_name(run->proto), run->size, run->window, run->loss, run->count,
+           res->goodput_mbps, res->p50_us, res->p99_us, res->p999_us, res->retrans_ratio,
+           res->cpu_s_per_gb, res->ok ? "" : "  FAILED");
+  }
+  fflush(stdout);
+}
+
+static void print_help(int code) {
+  printf("\nusage - sans-bench [options]\n"
+         "\n"
+         "  -p, proto     rudp, tcp or both (default both)\n"
+         "  -s, sizes     comma separated payload sizes in bytes (default 64,512,1400)\n"
+         "  -w, windows   comma separated window sizes in bytes, 0 for the default\n"
+         "                (default 0,262144)\n"
+         "  -l, losses    comma separated loss rates in [0, 1] (default 0,0.01)\n"
+         "  -n, count     messages per run (default 20000)\n"
+         "  -P, port      first port; each run uses the next one (default 45000)\n"
+         "  -f, format    table, csv or json (one object per line) (default table)\n"
+         "\n"
+         "RUDP payloads are capped at %d bytes and every payload holds at\n"
+         "least a %d byte header.  Lossy runs are RUDP only.\n", PKT_LEN, MSG_HDR_LEN);
+  exit(code);
+}
+
+/* Parse a comma separated list into `out`, returning how many were read. */
+static int parse_list(const char* arg, double* out, int max) {
+  int n = 0;
+  char* copy = strdup(arg);
+  char* save = NULL;
+  for (char* tok = strtok_r(copy, ",", &save); tok && n < max; tok = strtok_r(NULL, ",", &save)) {
+    char* end;
+    out[n] = strtod(tok, &end);
+    if (*end != '\0' || out[n] < 0) {
+      fprintf(stderr, "[ERROR] Bad value `%s`\n", tok);
+      free(copy);
+      print_help(-1);
+    }
+    n++;
+  }
+  free(copy);
+  return n;
+}
+
+#define MAX_SWEEP 16
+
+int main(int argc, char** argv) {
+  double sizes[MAX_SWEEP] = { 64, 512, PKT_LEN }, windows[MAX_SWEEP] = { 0, 262144 };
+  double losses[MAX_SWEEP] = { 0, 0.01 };
+  int nsizes = 3, nwindows = 2, nlosses = 2;
+  int protos[2] = { PROTO_RUDP, PROTO_TCP }, nprotos = 2;
+  int count = 20000, port = 45000, format = FMT_TABLE;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "p:s:w:l:n:P:f:h")) != -1) {
+    switch (opt) {
+    case 'p':
+      if (strcmp(optarg, "rudp") == 0) { protos[0] = PROTO_RUDP; nprotos = 1; }
+      else if (strcmp(optarg, "tcp") == 0) { protos[0] = PROTO_TCP; nprotos = 1; }
+      else if (strcmp(optarg, "both") != 0) print_help(-1);
+      break;
+    case 's': nsizes = parse_list(optarg, sizes, MAX_SWEEP); break;
+    case 'w': nwindows = parse_list(optarg, windows, MAX_SWEEP); break;
+    case 'l': nlosses = parse_list(optarg, losses, MAX_SWEEP); break;
+    case 'n': count = atoi(optarg); break;
+    case 'P': port = atoi(optarg); break;
+    case 'f':
+      if (strcmp(optarg, "csv") == 0) format = FMT_CSV;
+      else if (strcmp(optarg, "json") == 0) format = FMT_JSON;
+      else if (strcmp(optarg, "table") == 0) format = FMT_TABLE;
+      else print_help(-1);
+      break;
+    case 'h': print_help(0); break;
+    default: print_help(-1);
+    }
+  }
+  if (count <= 0 || port <= 0) print_help(-1);
+
+  { /*  Transport Driver thread  */
+    pthread_t backend_thread;
+    if (pthread_create(&backend_thread, NULL, rudp_backend, NULL) != 0) {
+      fprintf(stderr, "Failed to create background worker thread\n");
+      exit(-1);
+    }
+  }
+
+  int failures = 0;
+  print_header(format);
+  for (int p = 0; p < nprotos; p++)
+    for (int s = 0; s < nsizes; s++)
+      for (int w = 0; w < nwindows; w++)
+        for (int l = 0; l < nlosses; l++) {
+          if (protos[p] == PROTO_TCP && losses[l] > 0) continue;
+          struct bench_run run = {
+            .proto = protos[p],
+            .size = (int)sizes[s],
+            .window = (int)windows[w],
+            .loss = losses[l],
+            .count = count,
+            .port = port++,
+          };
+          if (run.size < MSG_HDR_LEN) run.size = MSG_HDR_LEN;
+          if (run.proto == PROTO_RUDP && run.size > PKT_LEN) run.size = PKT_LEN;
+          if (run.loss > 1) run.loss = 1;
+
+          struct bench_result res;
+          bench(&run, &res);
+          print_result(format, &run, &res);
+          failures += !res.ok;
+        }
+  return failures ? 1 : 0;
+}
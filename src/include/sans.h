@@ -1,5 +1,69 @@
 #define IPPROTO_RUDP 63
 
+/* per-connection options for sans_setopt() */
+#define SANS_OPT_CC 1          /* congestion control by name: "reno", "cubic" or "vegas" */
+#define SANS_OPT_HUGEPAGES 2   /* int: back send buffers with huge pages; set before the first send */
+#define SANS_OPT_UDP_OFFLOAD 3 /* int: batch sends with UDP GSO and accept GRO-coalesced receives */
+#define SANS_OPT_WINDOW_MAX 4  /* int: send window memory ceiling in bytes; set before the first send */
+#define SANS_OPT_IMPAIR 5      /* struct sans_impair: simulate a lossy path; all zero turns it off */
+#define SANS_OPT_ACK 6         /* struct sans_ack: when received data is acknowledged */
+
+/* Impairment applied to the datagrams a connection sends (SANS_OPT_IMPAIR).
+   Probabilities are per datagram in [0, 1]; zero disables each effect. */
+struct sans_impair {
+    double loss;            /* independent drop */
+    double burst_enter;     /* enter a loss burst (Gilbert-Elliott) */
+    double burst_exit;      /* leave it; datagrams in a burst are dropped */
+    double reorder;         /* hold a datagram back so later ones overtake it */
+    double duplicate;       /* send a datagram twice */
+    unsigned int reorder_us;  /* how long a reordered datagram is held, 0 for 1 ms */
+    unsigned int delay_us;    /* one-way delay */
+    unsigned int jitter_us;   /* extra delay, uniform in [0, jitter_us] */
+    unsigned int rate_kbps;   /* bottleneck rate, 0 for unlimited */
+    unsigned int queue_bytes; /* bottleneck buffer before tail drop, 0 for unlimited */
+    unsigned int seed;        /* same seed, same sequence of impairments */
+};
+
+/* Receiver ACK policy (SANS_OPT_ACK). An ACK goes out once `every`
+   packets are unacknowledged or `delay_us` after the first of them,
+   whichever comes first, and at once when data arrives out of order. A
+   DAT sent meanwhile carries it instead. every = 1 acknowledges each
+   receive batch as it is read. */
+struct sans_ack {
+    unsigned int every;       /* packets per ACK, at least 1 (default 2) */
+    unsigned int delay_us;    /* longest an ACK is held, at most 1000 (default 500) */
+};
+
+/* Per-connection transport counters, see sans_get_stats(). Counters run
+   for the connection's lifetime; the rest is a snapshot. */
+struct sans_stats {
+    unsigned long long packets_sent;  /* data transmissions, resends included */
+    unsigned long long bytes_sent;    /* payload bytes of those transmissions */
+    unsigned long long retransmits;   /* resends after a timeout or fast retransmit */
+    unsigned long long dupacks;       /* duplicate ACKs received */
+    unsigned long long blocked_us;    /* time sans_send_pkt() waited for window space */
+    unsigned long long ooo_dropped;   /* out-of-order packets past the reorder buffer */
+    unsigned long long rxq_dropped;   /* in-order packets refused while sans_recv_pkt() lagged */
+    unsigned long long acks_sent;     /* ACK datagrams sent; piggybacked ACKs are not counted */
+    unsigned int srtt_us;             /* smoothed round-trip time, 0 before the first sample */
+    unsigned int rttvar_us;           /* round-trip time variation */
+    unsigned int rto_us;              /* retransmit timeout, including backoff */
+    unsigned int queued;              /* packets in the send window: unacked or not yet sent */
+    unsigned int in_flight;           /* sent, neither acked nor SACKed */
+    unsigned int window;              /* packets the send window may hold right now */
+    unsigned int cwnd;                /* congestion window, packets */
+};
+
+/* Completion of a zero-copy send (sans_send_zc()): `buf` is no longer
+   referenced. status is 0 once the peer acknowledged every byte, -1 if the
+   connection closed first. It runs on whichever thread drops the last
+   reference: the backend thread when the final ACK arrives, the thread in
+   sans_disconnect() when the window is torn down, or the sending thread
+   itself when sans_send_zc() fails partway. In the first two the
+   connection's lock is held, so it must not block or call into sans_* for
+   the same socket. */
+typedef void (*sans_zc_done)(const char* buf, void* ctx, int status);
+
 int http_client(const char* host, int port);
 int http_server(const char* iface, int port);
 int smtp_agent(const char* host, int port);
@@ -7,10 +71,21 @@ int tcp_proxy(const char* host, int port);
 
 int sans_connect(const char* addr, int port, int protocol);
 int sans_accept(const char* addr, int port, int protocol);
+int sans_listen(const char* addr, int port, int protocol);
+int sans_accept_conn(int listener);
 int sans_send_data(int socket, const char* buf, int len);
+/* An RUDP socket's send window is a single-producer ring: only one thread
+   at a time may call sans_send_pkt(), sans_send_zc() or sans_send_file()
+   on it. Threads sharing a socket must serialize their sends. */
 int sans_send_pkt(int socket, const char* buf, int len);
+int sans_send_zc(int socket, const char* buf, int len, sans_zc_done done, void* ctx);
+long sans_send_file(int socket, int fd, long offset, long len);
 int sans_recv_data(int socket, char* buf, int len);
 int sans_recv_pkt(int socket, char* buf, int len);
 int sans_disconnect(int socket);
+int sans_setopt(int socket, int option, const void* value, int len);
+int sans_get_stats(int socket, struct sans_stats* stats);
+int sans_trace_dump(const char* path);
+int sans_trace_on_signal(int signo, const char* path);
 void* rudp_backend(void* unused);
 
@@ -6,45 +6,327 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <sys/types.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <endian.h>
+
+#define RUDP_VERSION 1 /* wire header version; packets of any other are dropped */
 
 #define DAT 0
 #define SYN 1
 #define ACK 2
 #define FIN 4
+#define PIGGYBACK 8 /* DAT whose ack and wnd fields acknowledge the reverse direction */
 
-#define MAX_SOCKETS 10
 #define PKT_LEN 1400
+#define RWND_SIZE 64 /* fewest out-of-order packets a receiver holds per connection */
+#define BACKLOG_MAX 128 /* a listener's connections not yet accepted */
+#define GRO_BUF_LEN 65536 /* largest datagram UDP_GRO can hand us */
+#define WND_MAX_DEFAULT (4u << 20) /* send window memory ceiling, bytes */
+#define ACK_EVERY 2          /* default packets per ACK (SANS_OPT_ACK) */
+#define ACK_DELAY_US 500     /* default longest an ACK is held */
+#define ACK_DELAY_MAX_US 1000 /* longest an ACK may be held; senders add it to the RTO */
 
-typedef struct {
-  uint8_t type;
-  uint32_t seqnum;
+/* wraparound-safe sequence number comparisons */
+#define SEQ_LT(a, b)  ((int32_t)((uint32_t)(a) - (uint32_t)(b)) < 0)
+#define SEQ_LEQ(a, b) ((int32_t)((uint32_t)(a) - (uint32_t)(b)) <= 0)
+
+/* Wire header, packed and little-endian on every host: read and write its
+   multi-byte fields through le16toh()/htole32() and friends. Control
+   packets (SYN, SYN|ACK, the handshake ACK) are header-only. */
+typedef struct __attribute__((packed)) {
+  uint8_t version;  /* RUDP_VERSION */
+  uint8_t type;     /* flags: DAT (none), SYN, ACK, FIN, PIGGYBACK */
+  uint16_t connid;  /* assigned by a listener in its SYN|ACK, 0 otherwise */
+  uint32_t seqnum;  /* DAT: the packet's sequence number */
+  uint32_t ack;     /* ACK, PIGGYBACK: next in-order seqnum expected; all before it arrived */
+  uint16_t wnd;     /* ACK, PIGGYBACK: more in-order packets the receiver can queue */
   uint8_t payload[PKT_LEN];
 } rudp_packet_t;
 
-/* forward-declare connection storage (defined in sans_socket.c) */
-extern struct rudp_conn {
-    int sockfd;
-    struct sockaddr_storage addr;
-    socklen_t addrlen;
-} rudp_conns[MAX_SOCKETS];
+/* bytes one full packet occupies on the wire, RUDP header included */
+#define DATAGRAM_LEN (offsetof(rudp_packet_t, payload) + PKT_LEN)
+
+/* a datagram long enough for the header and of our version */
+#define RUDP_HEADER_OK(buf, len) \
+  ((size_t)(len) >= offsetof(rudp_packet_t, payload) && ((const uint8_t*)(buf))[0] == RUDP_VERSION)
+
+#define MAX_SACK 4 /* SACK blocks carried by one ACK */
+
+/* Extended ACK payload: ranges [start, end] received beyond the cumulative
+   ACK in the header. A header-only ACK carries no blocks. Little-endian
+   on the wire like the header. */
+typedef struct __attribute__((packed)) {
+  uint8_t nblocks;
+  struct __attribute__((packed)) {
+    uint32_t start;
+    uint32_t end;
+  } blocks[MAX_SACK];
+} rudp_sack_t;
+
+/* Timers (sans_timer.c): a hierarchical wheel per connection for its
+   retransmits, and one in the backend for connection deadlines */
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 3
+#define WHEEL_TICK_SHIFT 8 /* 256 us ticks; three levels reach about 67 s */
+
+typedef struct rudp_timer {
+    struct rudp_timer* next;
+    struct rudp_timer** pprev; /* NULL while disarmed */
+    uint64_t expires_us;
+} rudp_timer_t;
+
+typedef struct {
+    uint64_t tick;                    /* next tick to run */
+    unsigned int count;               /* armed timers */
+    uint64_t occupied[WHEEL_LEVELS];  /* non-empty slots, one bit each */
+    rudp_timer_t* slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} rudp_wheel_t;
+
+void rudp_wheel_init(rudp_wheel_t* wheel, uint64_t now_us);
+void rudp_timer_arm(rudp_wheel_t* wheel, rudp_timer_t* timer, uint64_t expires_us);
+void rudp_timer_cancel(rudp_wheel_t* wheel, rudp_timer_t* timer);
+uint64_t rudp_wheel_next(const rudp_wheel_t* wheel);
+void rudp_wheel_run(rudp_wheel_t* wheel, uint64_t now_us,
+                    void (*fire)(rudp_timer_t* timer, void* arg), void* arg);
 
 /* send-window entry */
 typedef struct {
     int socket;
     rudp_packet_t* packet;
     size_t packetlen;
-    unsigned long last_sent_ms;
+    uint64_t last_sent_us;     /* CLOCK_MONOTONIC time of the latest transmission */
     unsigned char sent_once;
+    uint8_t transmits;         /* times sent; RTT is only sampled when this is 1 */
+    unsigned char sacked;      /* receiver holds it out of order; don't resend */
+    rudp_timer_t rto_timer;    /* armed while the packet is in flight */
+    const uint8_t* payload;    /* zero-copy: the caller's bytes, NULL if copied into `packet` */
+    struct rudp_zc* zc;        /* zero-copy: the send the payload belongs to */
 } swnd_entry_t;
 
-/* sequence counters placed together so test harness can find them */
-extern uint32_t seq_counters[2];
-#define send_seq (seq_counters[0])
-#define recv_seq (seq_counters[1])
+/* A zero-copy send (sans_send_zc(), sans_send_file()): its packets
+   reference the caller's buffer or a file mapping, which is handed back or
+   unmapped once the last of them is released. */
+struct rudp_zc {
+    _Atomic unsigned int refs; /* packets still referencing buf */
+    _Atomic int status;        /* 0, or -1 once a packet was dropped unacknowledged */
+    void (*done)(const char* buf, void* ctx, int status); /* NULL for a file */
+    void* ctx;
+    const char* buf;
+    void* map;                 /* sans_send_file(): the mapping to unmap, else NULL */
+    size_t map_len;
+};
+
+/* receive-side reorder slot */
+typedef struct {
+    size_t len;
+    unsigned char valid;
+    uint8_t payload[PKT_LEN];
+} rwnd_entry_t;
+
+/* per-window packet buffer pool (sans_pool.c) */
+typedef struct {
+    void* base;                  /* one cache-line aligned region */
+    size_t bytes;
+    unsigned int count;          /* buffers the region holds */
+    unsigned int carved;         /* buffers handed out */
+} rudp_pool_t;
+
+int rudp_pool_init(rudp_pool_t* pool, unsigned int count, int hugepages);
+void rudp_pool_destroy(rudp_pool_t* pool);
+rudp_packet_t* rudp_pool_get(rudp_pool_t* pool);
+
+/* Congestion control. Hooks run on the backend thread with conn->lock held
+   and adjust conn->cwnd / conn->ssthresh, both counted in packets. */
+#define CC_LOSS_FAST    0 /* loss inferred from duplicate ACKs */
+#define CC_LOSS_TIMEOUT 1 /* retransmit timer expired */
+
+struct rudp_conn;
+struct rudp_impair;
+struct sans_impair;
+typedef struct {
+    const char* name;
+    void (*init)(struct rudp_conn* conn);
+    void (*on_ack)(struct rudp_conn* conn, unsigned int acked, uint64_t now_us);
+    void (*on_loss)(struct rudp_conn* conn, int kind, uint64_t now_us);
+    void (*on_rtt)(struct rudp_conn* conn, uint64_t rtt_us, uint64_t now_us); /* optional */
+} rudp_cc_ops_t;
+
+extern const rudp_cc_ops_t rudp_cc_reno;
+extern const rudp_cc_ops_t rudp_cc_cubic;
+extern const rudp_cc_ops_t rudp_cc_vegas;
+extern const rudp_cc_ops_t* rudp_cc_default;
+const rudp_cc_ops_t* rudp_cc_find(const char* name);
+
+#define RXQ_MIN 16 /* initial delivery queue slots */
+
+/* Delivery queue: in-order payloads the backend has reassembled, waiting
+   for sans_recv_pkt(). The ring grows on demand, up to as many packets as
+   the reorder buffer holds; the valid flag of its slots is unused. */
+struct rudp_rxq {
+    pthread_mutex_t lock;
+    pthread_cond_t nonempty;
+    unsigned int head;
+    unsigned int count;
+    unsigned int cap;
+    int closed;                /* disconnected: readers stop waiting */
+    rwnd_entry_t* slots;
+};
+
+/* State shared by a listening socket and the connections it accepted
+   (sans_listen()). Reference counted: the listener, each connection and
+   each thread waiting in sans_accept_conn() hold one. */
+struct rudp_listener {
+    int sockfd;                  /* dup() of the listening socket, read until the last connection goes */
+    struct rudp_conn* conn;      /* the listening socket's connection */
+    unsigned char closed;        /* sans_disconnect() on the listening socket: accept nothing more */
+    pthread_mutex_t lock;
+    pthread_cond_t ready;        /* a completed handshake is queued */
+    struct rudp_conn** ids;      /* connections by connid; slot 0 unused */
+    unsigned int ids_cap;
+    unsigned int next_id;        /* where the search for a free connid starts */
+    struct rudp_conn* backlog;   /* handshaken, not yet returned by sans_accept_conn() */
+    struct rudp_conn* backlog_tail;
+    struct rudp_conn* syn_head;  /* handshakes in progress, oldest first */
+    struct rudp_conn* syn_tail;
+    unsigned int pending;        /* handshaking or in the backlog: new SYNs are dropped at BACKLOG_MAX */
+    unsigned int refs;
+    size_t sndbuf;               /* the shared socket's buffers, the most any connection asked for; */
+    size_t rcvbuf;               /* backend only */
+};
+
+/* Connection state, allocated per connection and indexed by the table in
+   sans_conn.c. Each connection owns its send window, sequence space and
+   retransmit state. The backend is the only reader of its socket; the
+   fields below `lock` are guarded by it, except the sender-owned ring
+   fields noted, and the application only touches `rxq`. */
+struct rudp_conn {
+    int sockfd;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int rx_fd;                 /* socket its datagrams arrive on: sockfd, or the listener's */
+    _Atomic unsigned int refs; /* the table's, plus one per rudp_conn_lookup() not yet put */
+    struct rudp_conn* next_dead; /* removed, awaiting rudp_conn_reap() */
+    struct rudp_conn* next_ready; /* link in the backend's ready list */
+    _Atomic unsigned char ready; /* on the ready list: has work for the backend */
+    rudp_timer_t deadline;     /* its next deadline in the backend's wheel (backend only) */
+    uint16_t connid;           /* stamped on every packet; 0 outside listener mode */
+    unsigned char listening;   /* this is a sans_listen() socket, not a connection */
+    unsigned char established; /* listener connection: 0 in handshake, 1 in backlog, 2 accepted */
+    struct rudp_listener* listener; /* listener mode: the shared socket's state */
+    struct rudp_conn* next_accept;  /* link in listener->backlog */
+    struct rudp_conn* next_syn;     /* links in listener->syn_head while handshaking */
+    struct rudp_conn* prev_syn;
+    uint64_t syn_us;           /* when its handshake began, 0 once it is over */
+    struct rudp_rxq rxq;       /* payloads ready for sans_recv_pkt() */
+
+    pthread_mutex_t lock;      /* control plane and backend servicing; a send takes it only to create the window */
+    swnd_entry_t* window;      /* ring of wnd_cap entries, allocated on first send */
+    unsigned int wnd_cap;      /* slots allocated: the memory ceiling in packets */
+    _Atomic unsigned int wnd_limit; /* slots the sender may fill, tuned to the BDP */
+    size_t wnd_max_bytes;      /* memory ceiling (SANS_OPT_WINDOW_MAX), 0 for the default */
+    size_t sndbuf;             /* SO_SNDBUF last set, 0 if untouched */
+    size_t rcvbuf;             /* SO_RCVBUF last set, 0 if untouched */
+    uint32_t rx_drops;         /* receive-queue overflows reported by SO_RXQ_OVFL */
+    uint64_t packets_sent;     /* data transmissions, first sends and resends */
+    uint64_t bytes_sent;       /* payload bytes of those transmissions */
+    uint64_t retransmits;      /* of which resends */
+    uint64_t dupacks_seen;     /* duplicate ACKs received */
+    uint64_t ooo_dropped;      /* future packets beyond the reorder buffer */
+    uint64_t rxq_dropped;      /* in-order packets refused while the reader lagged */
+    uint64_t acks_sent;        /* standalone ACK datagrams */
+    _Atomic uint64_t blocked_us; /* time the sender waited for a window slot (sending thread) */
+    rudp_pool_t pool;          /* packet buffers for the window's entries */
+    unsigned char hugepages;   /* back the pool with huge pages (SANS_OPT_HUGEPAGES) */
+    unsigned char udp_offload; /* UDP_SEGMENT sends and UDP_GRO receives (SANS_OPT_UDP_OFFLOAD) */
+    unsigned int swnd_head;    /* next slot to write to (sending thread only) */
+    unsigned int swnd_tail;    /* oldest unacked packet (backend only) */
+    unsigned int swnd_count;   /* packets the backend has taken from the ring */
+    _Atomic unsigned int ring_count;   /* packets submitted and not yet released; futex word */
+    _Atomic unsigned int ring_waiters; /* a sender or drain_window() sleeps on ring_count */
+    _Atomic unsigned char closing;     /* window released by a disconnect: sends fail */
+    _Atomic unsigned int senders;      /* sending threads inside enqueue(); release_window() waits for 0 */
+    uint32_t send_seq;         /* next sequence number to assign (sending thread only) */
+    uint32_t snd_max;          /* one past the newest seqnum the backend has taken */
+    uint64_t srtt_us;          /* smoothed round-trip time, 0 until first sample */
+    uint64_t rttvar_us;        /* round-trip time variation */
+    uint64_t rto_us;           /* current retransmit timeout, including backoff */
+    rudp_wheel_t* timers;      /* retransmit deadlines of in-flight packets */
+    uint64_t retry_us;         /* a send found the socket buffer full: try again then, 0 if not */
+    uint64_t round_start_us;   /* window autotuning: when the current round began */
+    uint32_t round_end;        /* the round ends once this seqnum is acknowledged */
+    uint32_t round_delivered;  /* packets acknowledged during the round */
+    uint32_t last_ack;         /* highest cumulative ACK seen */
+    uint32_t peer_wnd;         /* in-order packets the peer last said it can queue */
+    unsigned int dupacks;      /* repeats of last_ack while packets are outstanding */
+    const rudp_cc_ops_t* cc;   /* congestion controller, rudp_cc_default if unset */
+    uint32_t cwnd;             /* congestion window, packets */
+    uint32_t ssthresh;         /* slow-start threshold, packets */
+    uint32_t cwnd_cnt;         /* acked packets towards the next additive increase */
+    uint32_t in_flight;        /* sent, not yet acked or SACKed */
+    uint32_t recover;          /* highest seqnum sent when recovery began */
+    unsigned char in_recovery; /* a loss was signalled and is not yet repaired */
+    uint64_t cc_priv[8];       /* algorithm-private state */
+    uint32_t recv_seq;         /* next in-order sequence number expected */
+    rwnd_entry_t* reorder;     /* reorder_cap future packets, indexed by seqnum */
+    unsigned int reorder_cap;  /* what the memory ceiling allows rounded up to a power of two, at least RWND_SIZE */
+    uint32_t reorder_end;      /* one past the highest seqnum ever buffered */
+    unsigned int ack_every;    /* ACK policy (SANS_OPT_ACK): packets per ACK */
+    unsigned int ack_delay_us; /* and the longest an ACK is held */
+    unsigned int ack_owed;     /* data packets received since the last ACK */
+    unsigned char ack_now;     /* out-of-order arrival: acknowledge without delay */
+    unsigned char ack_pending; /* an ACK is being held */
+    uint64_t ack_due_us;       /* send the held ACK alone by then */
+    unsigned char gro;         /* UDP_GRO on: received datagrams may be coalesced */
+    struct rudp_impair* impair; /* simulated path impairment (SANS_OPT_IMPAIR), NULL if off */
+    unsigned char watched;     /* socket registered with the backend's epoll set */
+};
+
+/* Connection table (sans_conn.c) */
+struct rudp_conn* rudp_conn_lookup(int sockfd);
+struct rudp_conn* rudp_conn_lookup_addr(int sockfd, const struct sockaddr* addr);
+struct rudp_conn* save_rudp_conn(int sockfd, int rx_fd, struct sockaddr* addr, socklen_t addrlen);
+void rudp_conn_put(struct rudp_conn* conn);
+void rudp_conn_unlink(struct rudp_conn* conn);
+void rudp_conn_remove(struct rudp_conn* conn);
+void rudp_conn_reap(void);
 
 /* Backend / transport API */
-void enqueue_packet(int sock, const uint8_t* buf, size_t len);
+int enqueue_packet(int sock, const uint8_t* buf, size_t len);
+int enqueue_zc(int sock, const uint8_t* buf, size_t len, struct rudp_zc* zc);
+void zc_release(struct rudp_zc* zc, unsigned int n, int status);
+void drain_window(struct rudp_conn* conn);
+void release_window(struct rudp_conn* conn);
+size_t gro_segment_size(struct msghdr* msg, size_t len);
+size_t window_ceiling(const struct rudp_conn* conn);
+void tune_sockbuf(struct rudp_conn* conn, int optname, size_t bytes);
+int watch_socket(struct rudp_conn* conn);
+int watch_listener(struct rudp_conn* conn);
+void close_listener(struct rudp_conn* conn);
+void release_listener(struct rudp_conn* conn);
+void put_listener(struct rudp_listener* l);
+void receive_data(struct rudp_conn* conn, const rudp_packet_t* pkt, size_t len);
+void ack_header(struct rudp_conn* conn, rudp_packet_t* hdr);
+void send_ack(struct rudp_conn* conn);
+void acknowledge(struct rudp_conn* conn, unsigned int n, uint64_t now);
+void note_drops(struct rudp_conn* conn, struct msghdr* msg);
 void* rudp_backend(void* unused);
 void init_rudp_backend(void);
+void wake_backend(void);
+void ready_conn(struct rudp_conn* conn);
+void unschedule_conn(struct rudp_conn* conn);
+
+/* Packet trace (sans_trace.c) */
+#define TRACE_IN 0
+#define TRACE_OUT 1
+void rudp_trace(int dir, int sockfd, const void* pkt, size_t len, uint64_t now_us);
+void trace_poll(void);
+
+/* Impairment simulator (sans_impair.c) */
+int impair_configure(struct rudp_conn* conn, const struct sans_impair* cfg);
+void impair_send(struct rudp_conn* conn, const void* buf, size_t len);
+uint64_t impair_flush(uint64_t now);
+void impair_release(struct rudp_conn* conn);
 
 #endif
@@ -6,10 +6,6 @@
 #include "include/sans.h"
 #include "include/rudp.h"
 
-/* place sequence counters in this translation unit so the test harness
-  can find them in the data segment */
-uint32_t seq_counters[2] = {0, 0};
-
 /*
  *  SANS - Scholastic Applied Network Sandbox
  */
@@ -1,223 +1,1370 @@
+#define _GNU_SOURCE
 #include "rudp.h"
 
-/* Define MAX_SOCKETS locally to avoid include dependency issues */
-#ifndef MAX_SOCKETS
-#define MAX_SOCKETS 10
-#endif
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
+#include <time.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 #include <sys/socket.h>
-#include <sys/time.h>
+#include <netinet/udp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include "include/sans.h"
 
-/* Export send_window and swnd_size for test harness */
+#define RTO_INIT_US 100000UL   /* retransmit timeout before the first RTT sample */
+#define RTO_MIN_US 2000UL       /* floor: keeps a slow reader from causing spurious resends */
+#define RTO_MAX_US 60000000UL   /* ceiling for exponential backoff */
+#define DUPACK_THRESHOLD 3      /* duplicate ACKs that trigger a fast retransmit */
+#define LINGER_MS 2000    /* how long a disconnect waits for the window to drain */
+#define MAX_EVENTS 16     /* epoll events handled per wakeup */
+#define IO_BATCH 64       /* datagrams per sendmmsg()/recvmmsg() call */
+#define GSO_MAX_SEGS 46   /* full packets per UDP_SEGMENT super-buffer (under 64 KB) */
+#define SEND_RETRY_US 500 /* when to try again after a send found the socket buffer full */
+#define SOCKBUF_MIN (256 * 1024) /* never tune socket buffers below this */
+#define CONNID_MAX UINT16_MAX    /* connection IDs one listener can hand out */
+#define HANDSHAKE_TIMEOUT_US 5000000UL /* a half-open connection is dropped after this */
+
+/* Export send_window and swnd_size for the test harness. Each connection
+   owns its window; send_window is the one created most recently. */
 swnd_entry_t* send_window = NULL;
-const unsigned int swnd_size = 20; /* sliding window with 20 slots */
+const unsigned int swnd_size = 20; /* initial window, slots; autotuning never goes below it */
 
-/* Internal state */
-static pthread_mutex_t swnd_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_once_t init_once = PTHREAD_ONCE_INIT;
-static unsigned int swnd_head = 0; /* next slot to write to */
-static unsigned int swnd_tail = 0; /* oldest unacked packet */
-static unsigned int swnd_count = 0; /* number of packets in window */
-
-static void initialize_window(void) {
-  send_window = calloc(swnd_size, sizeof(swnd_entry_t));
-  if (!send_window) { perror("calloc"); return; }
-  for (unsigned i = 0; i < swnd_size; i++) send_window[i].socket = -1;
-  swnd_head = 0;
-  swnd_tail = 0;
-  swnd_count = 0;
-}
-
-void enqueue_packet(int sock, const uint8_t* buf, size_t len) {
-  /* ensure window is allocated (thread-safe) */
-  pthread_once(&init_once, initialize_window);
-  
-  pthread_mutex_lock(&swnd_mutex);
-  if (!send_window) {
-    pthread_mutex_unlock(&swnd_mutex);
-    return; /* initialization failed */
-  }
-
-  /* block until a slot is free (window full) */
-  while (swnd_count >= swnd_size) {
-    pthread_mutex_unlock(&swnd_mutex);
-    usleep(1000);
-    pthread_mutex_lock(&swnd_mutex);
-  }
-
-  /* insert at head, using ring buffer */
-  swnd_entry_t* entry = &send_window[swnd_head];
+
+/* Event sources driving the backend thread */
+static int epoll_fd = -1;  /* readiness of sockets, timer and wakeups */
+static int timer_fd = -1;  /* fires at the earliest connection deadline */
+static int wake_fd = -1;   /* signalled by enqueue_packet() */
+static atomic_int wake_pending; /* a wake_fd write is outstanding */
+
+/* A wakeup only touches connections with work: those on the ready list,
+   pushed by any thread when packets are queued or ACKs arrive, and those
+   whose deadline (retransmit, held ACK, send retry) came due in the
+   backend's wheel, which holds one timer per connection. */
+static _Atomic(struct rudp_conn*) ready_head;
+static rudp_wheel_t deadlines; /* backend thread only */
+
+static uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000UL + (uint64_t)(ts.tv_nsec / 1000L);
+}
+
+static void initialize_backend(void) {
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (epoll_fd < 0 || timer_fd < 0 || wake_fd < 0) {
+    perror("rudp backend");
+    return;
+  }
+
+  /* the timer and eventfd are told apart from sockets by data.ptr */
+  struct epoll_event ev = { .events = EPOLLIN };
+  ev.data.ptr = &timer_fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev);
+  ev.data.ptr = &wake_fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+  rudp_wheel_init(&deadlines, now_us());
+}
+
+/* Sleep while *word still holds `expected`, at most `timeout` (NULL: forever). */
+static void futex_wait(_Atomic unsigned int* word, unsigned int expected, const struct timespec* timeout) {
+  syscall(SYS_futex, (unsigned int*)word, FUTEX_WAIT_PRIVATE, expected, timeout, NULL, 0);
+}
+
+static void futex_wake(_Atomic unsigned int* word) {
+  syscall(SYS_futex, (unsigned int*)word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+/* Sleep until the backend releases slots, i.e. ring_count moves off `seen`. */
+static void wait_ring(struct rudp_conn* conn, unsigned int seen, const struct timespec* timeout) {
+  atomic_store(&conn->ring_waiters, 1);
+  /* pairs with release_slots(): either we see its update or it sees us */
+  if (atomic_load(&conn->ring_count) == seen)
+    futex_wait(&conn->ring_count, seen, timeout);
+}
+
+/* memory a connection may spend on each of its send and reorder windows */
+size_t window_ceiling(const struct rudp_conn* conn) {
+  return conn->wnd_max_bytes ? conn->wnd_max_bytes : WND_MAX_DEFAULT;
+}
+
+/* the i-th oldest packet in the window */
+static swnd_entry_t* window_at(struct rudp_conn* conn, unsigned int i) {
+  return &conn->window[(conn->swnd_tail + i) % conn->wnd_cap];
+}
+
+/* an entry's sequence number, kept in wire order in its header */
+static uint32_t entry_seq(const swnd_entry_t* entry) {
+  return le32toh(entry->packet->seqnum);
+}
+
+/* Allocate a connection's window on its first send. Slots are reserved up
+   to the memory ceiling; the sender starts out limited to swnd_size of them.
+   Caller holds conn->lock. */
+static int initialize_window(struct rudp_conn* conn) {
+  unsigned int cap = (unsigned int)(window_ceiling(conn) / DATAGRAM_LEN);
+  if (cap < swnd_size) cap = swnd_size;
+
+  conn->window = calloc(cap, sizeof(swnd_entry_t));
+  conn->timers = malloc(sizeof(*conn->timers));
+  if (!conn->window || !conn->timers) {
+    perror("calloc");
+    free(conn->window);
+    free(conn->timers);
+    conn->window = NULL;
+    conn->timers = NULL;
+    return -1;
+  }
+  if (rudp_pool_init(&conn->pool, cap, conn->hugepages) < 0) {
+    free(conn->window);
+    free(conn->timers);
+    conn->window = NULL;
+    conn->timers = NULL;
+    return -1;
+  }
+  rudp_wheel_init(conn->timers, now_us());
+  /* each slot keeps its buffer for the window's lifetime, so the sender
+     and the backend never share the pool */
+  for (unsigned i = 0; i < cap; i++) {
+    conn->window[i].socket = -1;
+    conn->window[i].packet = rudp_pool_get(&conn->pool);
+  }
+  conn->wnd_cap = cap;
+  send_window = conn->window;
+  atomic_store(&conn->wnd_limit, swnd_size);
+  conn->round_start_us = 0;
+  conn->round_delivered = 0;
+  conn->swnd_head = 0;
+  conn->swnd_tail = 0;
+  conn->swnd_count = 0;
+  atomic_store(&conn->ring_count, 0);
+  conn->snd_max = conn->send_seq;
+  conn->srtt_us = 0;
+  conn->rttvar_us = 0;
+  conn->rto_us = RTO_INIT_US;
+  conn->last_ack = conn->send_seq - 1;
+  conn->peer_wnd = UINT16_MAX; /* until the first ACK says otherwise */
+  conn->dupacks = 0;
+  conn->in_flight = 0;
+  conn->in_recovery = 0;
+  if (!conn->cc) conn->cc = rudp_cc_default;
+  conn->cc->init(conn);
+  return 0;
+}
+
+/* wake the backend thread; safe to call with or without a conn lock held,
+   and from a signal handler. Writes are coalesced until the backend next
+   looks at the rings. */
+void wake_backend(void) {
+  if (wake_fd < 0 || atomic_exchange(&wake_pending, 1)) return;
+  uint64_t one = 1;
+  if (write(wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    perror("eventfd");
+}
+
+/* Queue a connection for the backend's next pass; any thread. The table
+   keeps a removed connection allocated while it is queued. */
+void ready_conn(struct rudp_conn* conn) {
+  if (atomic_exchange(&conn->ready, 1)) return;
+  struct rudp_conn* head = atomic_load(&ready_head);
+  do conn->next_ready = head;
+  while (!atomic_compare_exchange_weak(&ready_head, &head, conn));
+}
+
+/* A sending thread is done with the window: let a release_window() waiting
+   for it proceed. */
+static void leave_window(struct rudp_conn* conn) {
+  if (atomic_fetch_sub(&conn->senders, 1) == 1 && atomic_load(&conn->closing))
+    futex_wake(&conn->senders);
+}
+
+/* Queue one packet on `conn`, which the caller holds a reference to. */
+static int enqueue_conn(struct rudp_conn* conn, int sock, const uint8_t* buf, size_t len,
+                        struct rudp_zc* zc) {
+  /* the window is a single-producer ring: the sending thread owns swnd_head
+     and the free slots, the backend owns everything it has taken. While
+     counted in `senders` the window stays allocated; release_window() sets
+     `closing` first and then waits for the count to drain.
+     Only the first send takes the lock, to create the window (wnd_limit is
+     0 until then); it is counted before unlocking, since release_window()
+     waits for the count with the lock held */
+  if (atomic_load(&conn->wnd_limit) == 0) {
+    pthread_mutex_lock(&conn->lock);
+    int created = !atomic_load(&conn->closing) && !conn->window;
+    int failed = created && initialize_window(conn) < 0;
+    if (!failed) atomic_fetch_add(&conn->senders, 1);
+    pthread_mutex_unlock(&conn->lock);
+    if (failed) return -1;
+  }
+  else {
+    atomic_fetch_add(&conn->senders, 1);
+  }
+  /* a disconnect that came before the count was taken has already torn
+     the window down */
+  if (atomic_load(&conn->closing)) {
+    leave_window(conn);
+    errno = EPIPE;
+    return -1;
+  }
+
+  /* block until the backend frees a slot (window full) or a disconnect
+     tears the window down; only a sender that has to wait reads the clock */
+  unsigned int count;
+  uint64_t blocked_since = 0;
+  while (!atomic_load(&conn->closing) &&
+         (count = atomic_load_explicit(&conn->ring_count, memory_order_acquire)) >=
+         atomic_load(&conn->wnd_limit)) {
+    if (!blocked_since) blocked_since = now_us();
+    wait_ring(conn, count, NULL);
+  }
+  if (blocked_since)
+    atomic_fetch_add_explicit(&conn->blocked_us, now_us() - blocked_since, memory_order_relaxed);
+  /* checked once the slot is ours: a disconnect may have come meanwhile */
+  if (atomic_load(&conn->closing)) {
+    leave_window(conn);
+    errno = EPIPE;
+    return -1;
+  }
+
+  /* insert at head; only header and payload of the slot's buffer are written */
+  swnd_entry_t* entry = &conn->window[conn->swnd_head];
   entry->socket = sock;
-  entry->packet = malloc(sizeof(rudp_packet_t));
-  if (!entry->packet) { perror("malloc"); entry->socket = -1; pthread_mutex_unlock(&swnd_mutex); return; }
-  /* zero initialize full packet buffer */
-  memset(entry->packet, 0, sizeof(rudp_packet_t));
+  entry->packet->version = RUDP_VERSION;
   entry->packet->type = DAT;
-  entry->packet->seqnum = send_seq++;
+  entry->packet->connid = htole16(conn->connid);
+  entry->packet->seqnum = htole32(conn->send_seq++);
+  entry->packet->ack = 0;
+  entry->packet->wnd = 0;
   size_t copy_len = len;
   if (copy_len > PKT_LEN) copy_len = PKT_LEN;
-  memcpy(entry->packet->payload, buf, copy_len);
+  if (zc) {
+    entry->payload = buf;
+    entry->zc = zc;
+  }
+  else {
+    memcpy(entry->packet->payload, buf, copy_len);
+  }
   entry->packetlen = copy_len;
-  entry->last_sent_ms = 0;
+  entry->last_sent_us = 0;
   entry->sent_once = 0;
+  entry->transmits = 0;
+  entry->sacked = 0;
 
-  swnd_head = (swnd_head + 1) % swnd_size;
-  swnd_count++;
+  conn->swnd_head = (conn->swnd_head + 1) % conn->wnd_cap;
 
-  pthread_mutex_unlock(&swnd_mutex);
+  /* publish: the backend reads the entry once it sees the new count; the
+     connection is queued while counted, before a disconnect can free it */
+  atomic_fetch_add(&conn->ring_count, 1);
+  ready_conn(conn);
+  leave_window(conn);
+  wake_backend();
+  return 0;
 }
 
-void dequeue_packet(unsigned int seqnum) {
-  pthread_mutex_lock(&swnd_mutex);
-  if (!send_window || swnd_count == 0) {
-    pthread_mutex_unlock(&swnd_mutex);
-    return;
+/* Queue one packet. With `zc` set the payload stays in the caller's
+   buffer and the entry holds a reference to the send it belongs to. */
+static int enqueue(int sock, const uint8_t* buf, size_t len, struct rudp_zc* zc) {
+  pthread_once(&init_once, initialize_backend);
+  if (wake_fd < 0) return -1; /* initialization failed */
+
+  struct rudp_conn* conn = rudp_conn_lookup(sock);
+  if (!conn) { errno = ENOTCONN; return -1; }
+  int rc = enqueue_conn(conn, sock, buf, len, zc);
+  rudp_conn_put(conn);
+  return rc;
+}
+
+int enqueue_packet(int sock, const uint8_t* buf, size_t len) {
+  return enqueue(sock, buf, len, NULL);
+}
+
+/* Queue a packet whose payload (at most PKT_LEN bytes) is referenced, not
+   copied, until it is acknowledged. */
+int enqueue_zc(int sock, const uint8_t* buf, size_t len, struct rudp_zc* zc) {
+  return enqueue(sock, buf, len, zc);
+}
+
+/* In-flight accounting: an entry occupies the congestion window while it has
+   been sent and is neither acknowledged nor SACKed. */
+static int in_flight(const swnd_entry_t* entry) {
+  return entry->sent_once && !entry->sacked;
+}
+
+/* queue an entry for retransmission. Caller holds conn->lock. */
+static void mark_lost(struct rudp_conn* conn, swnd_entry_t* entry) {
+  if (in_flight(entry)) conn->in_flight--;
+  rudp_timer_cancel(conn->timers, &entry->rto_timer);
+  entry->sent_once = 0;
+}
+
+static void mark_sacked(struct rudp_conn* conn, swnd_entry_t* entry) {
+  if (in_flight(entry)) conn->in_flight--;
+  rudp_timer_cancel(conn->timers, &entry->rto_timer);
+  entry->sacked = 1;
+}
+
+/* Empty a slot. A zero-copy payload is handed back with `status`: 0 once
+   acknowledged, -1 when the window is torn down first. */
+static void clear_entry(struct rudp_conn* conn, swnd_entry_t* entry, int status) {
+  if (in_flight(entry)) conn->in_flight--;
+  rudp_timer_cancel(conn->timers, &entry->rto_timer);
+  if (entry->zc) {
+    zc_release(entry->zc, 1, status);
+    entry->zc = NULL;
+    entry->payload = NULL;
   }
+  entry->socket = -1;
+  entry->packetlen = 0;
+  entry->last_sent_us = 0;
+  entry->sent_once = 0;
+  entry->transmits = 0;
+  entry->sacked = 0;
+}
+
+/* Fold one RTT measurement into the connection's estimator (RFC 6298) and
+   recompute the RTO, which also clears any backoff. As in QUIC, the RTO
+   allows for the longest the peer may hold its ACK, so a delayed ACK never
+   looks like a loss. Caller holds conn->lock. */
+static void rtt_sample(struct rudp_conn* conn, uint64_t rtt, uint64_t now) {
+  if (conn->srtt_us == 0) {
+    conn->srtt_us = rtt;
+    conn->rttvar_us = rtt / 2;
+  }
+  else {
+    uint64_t err = rtt > conn->srtt_us ? rtt - conn->srtt_us : conn->srtt_us - rtt;
+    conn->rttvar_us = (3 * conn->rttvar_us + err) / 4;
+    conn->srtt_us = (7 * conn->srtt_us + rtt) / 8;
+  }
+  if (conn->cc->on_rtt) conn->cc->on_rtt(conn, rtt, now);
+
+  uint64_t rto = conn->srtt_us + 4 * conn->rttvar_us + ACK_DELAY_MAX_US;
+  if (rto < RTO_MIN_US) rto = RTO_MIN_US;
+  if (rto > RTO_MAX_US) rto = RTO_MAX_US;
+  conn->rto_us = rto;
+}
+
+/* Karn's rule: only packets transmitted exactly once give an unambiguous sample */
+static void sample_entry(struct rudp_conn* conn, const swnd_entry_t* entry, uint64_t now) {
+  if (entry->transmits == 1 && !entry->sacked && now >= entry->last_sent_us)
+    rtt_sample(conn, now - entry->last_sent_us, now);
+}
+
+/* Hand `n` slots at the tail back to the sending thread, waking it if it
+   sleeps on a full window. Caller holds conn->lock. */
+static void release_slots(struct rudp_conn* conn, unsigned int n) {
+  conn->swnd_tail = (conn->swnd_tail + n) % conn->wnd_cap;
+  conn->swnd_count -= n;
+  atomic_fetch_sub(&conn->ring_count, n);
+  if (atomic_exchange(&conn->ring_waiters, 0))
+    futex_wake(&conn->ring_count);
+}
 
-  /* Remove all packets from tail up to and including seqnum */
-  while (swnd_count > 0) {
-    swnd_entry_t* entry = &send_window[swnd_tail];
-    if (entry->packet && entry->packet->seqnum <= seqnum) {
-      free(entry->packet);
-      entry->packet = NULL;
-      entry->socket = -1;
-      entry->packetlen = 0;
-      entry->last_sent_ms = 0;
-      entry->sent_once = 0;
-      swnd_tail = (swnd_tail + 1) % swnd_size;
-      swnd_count--;
-    } else {
+/* Take packets the sending thread has published since the last look.
+   Caller holds conn->lock. */
+static void take_submitted(struct rudp_conn* conn) {
+  unsigned int count = atomic_load(&conn->ring_count);
+  if (count == conn->swnd_count) return;
+  conn->swnd_count = count;
+  conn->snd_max = entry_seq(window_at(conn, count - 1)) + 1;
+}
+
+/* Remove all packets from tail up to and including seqnum, taking an RTT
+   sample from the newest one. Caller holds conn->lock. */
+static unsigned int release_acked(struct rudp_conn* conn, uint32_t seqnum, uint64_t now) {
+  unsigned int released = 0;
+  while (released < conn->swnd_count) {
+    swnd_entry_t* entry = window_at(conn, released);
+    if (!SEQ_LEQ(entry_seq(entry), seqnum)) break;
+    if (entry_seq(entry) == seqnum) sample_entry(conn, entry, now);
+    clear_entry(conn, entry, 0);
+    released++;
+  }
+  if (released) release_slots(conn, released);
+  return released;
+}
+
+/* Block until every queued packet is acknowledged or LINGER_MS passes.
+   Called from the sending thread. */
+void drain_window(struct rudp_conn* conn) {
+  uint64_t deadline = now_us() + LINGER_MS * 1000UL;
+  unsigned int count;
+  while ((count = atomic_load(&conn->ring_count)) > 0) {
+    uint64_t now = now_us();
+    if (now >= deadline) break;
+    struct timespec left = {
+      .tv_sec = (time_t)((deadline - now) / 1000000),
+      .tv_nsec = (long)((deadline - now) % 1000000) * 1000L,
+    };
+    wait_ring(conn, count, &left);
+  }
+}
+
+static void unwatch_socket(struct rudp_conn* conn);
+
+/* Free a connection's window and reorder buffer and reset its sequence
+   space. Senders blocked on the window, and any later ones, fail with
+   EPIPE; the window is freed once the last sender inside enqueue() has
+   left. Caller holds conn->lock. */
+void release_window(struct rudp_conn* conn) {
+  /* readers blocked in sans_recv_pkt() give up; their lookup reference
+     keeps the queue allocated until they have left */
+  pthread_mutex_lock(&conn->rxq.lock);
+  conn->rxq.closed = 1;
+  pthread_cond_broadcast(&conn->rxq.nonempty);
+  pthread_mutex_unlock(&conn->rxq.lock);
+
+  atomic_store(&conn->closing, 1);
+  /* move the word a blocked sender sleeps on, so one about to sleep
+     returns at once, and wake any that already does */
+  atomic_fetch_add(&conn->ring_count, 1);
+  futex_wake(&conn->ring_count);
+  unsigned int senders;
+  while ((senders = atomic_load(&conn->senders)) != 0)
+    futex_wait(&conn->senders, senders, NULL);
+
+  if (conn->ack_pending) send_ack(conn);
+  if (conn->window) {
+    for (unsigned int i = 0; i < conn->wnd_cap; i++) clear_entry(conn, &conn->window[i], -1);
+    if (send_window == conn->window) send_window = NULL;
+    free(conn->window);
+    conn->window = NULL;
+    free(conn->timers);
+    conn->timers = NULL;
+    rudp_pool_destroy(&conn->pool);
+  }
+  conn->swnd_head = conn->swnd_tail = conn->swnd_count = conn->wnd_cap = 0;
+  atomic_store(&conn->ring_count, 0);
+  atomic_store(&conn->wnd_limit, 0);
+  conn->send_seq = conn->snd_max = conn->recv_seq = 0;
+  free(conn->reorder);
+  conn->reorder = NULL;
+  conn->reorder_cap = 0;
+  conn->reorder_end = 0;
+  conn->ack_owed = 0;
+  conn->ack_now = 0;
+  conn->gro = 0;
+  conn->udp_offload = 0;
+  impair_release(conn);
+  conn->cc = NULL;
+  unwatch_socket(conn);
+}
+
+/* Hand a new connection's socket to the backend, which is its only reader
+   from then on. */
+int watch_socket(struct rudp_conn* conn) {
+  pthread_once(&init_once, initialize_backend);
+  if (epoll_fd < 0) return -1;
+  /* a listener's connections are read through the listening socket */
+  if (conn->watched || conn->listener) return 0;
+
+  struct epoll_event ev = { .events = EPOLLIN };
+  ev.data.ptr = conn;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->sockfd, &ev) < 0 && errno != EEXIST) return -1;
+  conn->watched = 1;
+  return 0;
+}
+
+/* stop reading a socket that is about to be closed */
+static void unwatch_socket(struct rudp_conn* conn) {
+  if (!conn->watched) return;
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->sockfd, NULL);
+  conn->watched = 0;
+}
+
+/* Send packets that are due, oldest first, while the congestion window
+   has room. Everything due goes out in sendmmsg() batches of IO_BATCH.
+   With UDP offload on, each message is a UDP_SEGMENT super-buffer of up
+   to GSO_MAX_SEGS packets that the kernel splits at the packet size.
+   A zero-copy packet goes out as two iovecs, its header from the window
+   and its payload from the caller's buffer. A pending ACK rides along in
+   the headers as PIGGYBACK. Sends never block: when the socket buffer
+   is full or the send fails, the rest is retried at conn->retry_us.
+   Caller holds conn->lock. */
+static void transmit_pending(struct rudp_conn* conn, uint64_t now) {
+  static struct mmsghdr msgs[IO_BATCH];
+  static struct iovec iovs[IO_BATCH * GSO_MAX_SEGS * 2];
+  static swnd_entry_t* batch[IO_BATCH * GSO_MAX_SEGS];
+  static unsigned int msg_pkts[IO_BATCH];
+  static char ctrl[IO_BATCH][CMSG_SPACE(sizeof(uint16_t))];
+  static _Alignas(rudp_packet_t) uint8_t flat[DATAGRAM_LEN];
+  /* header size: use offsetof to allow flexible struct layout */
+  const size_t hdr_size = offsetof(rudp_packet_t, payload);
+  const uint16_t gso_size = (uint16_t)(hdr_size + PKT_LEN);
+
+  if (conn->addrlen == 0) return;
+  conn->retry_us = 0;
+
+  rudp_packet_t ack;
+  int piggyback = conn->ack_pending;
+  if (piggyback) ack_header(conn, &ack);
+
+  /* the congestion window, within what the receiver advertised; one packet
+     may always go out, so a closed window is probed by its retransmits */
+  uint32_t limit = conn->cwnd < conn->peer_wnd ? conn->cwnd : conn->peer_wnd;
+  if (limit == 0) limit = 1;
+
+  unsigned int i = 0;
+  while (i < conn->swnd_count && conn->in_flight < limit) {
+    /* impairment acts per packet, so it sees every one separately */
+    unsigned int max_segs = conn->udp_offload && !conn->impair ? GSO_MAX_SEGS : 1;
+    unsigned int start = i, nmsg = 0, npkt = 0, niov = 0, segs = 0;
+    int extendable = 0;
+
+    for (; i < conn->swnd_count && conn->in_flight + npkt < limit; i++) {
+      swnd_entry_t* entry = window_at(conn, i);
+      if (entry->sent_once || entry->sacked) continue;
+
+      /* only full-size packets may be followed by another segment */
+      if (!extendable || segs == max_segs) {
+        if (nmsg == IO_BATCH) break;
+        msgs[nmsg].msg_hdr = (struct msghdr) {
+          .msg_name = &conn->addr,
+          .msg_namelen = conn->addrlen,
+          .msg_iov = &iovs[niov],
+          .msg_iovlen = 0,
+        };
+        msg_pkts[nmsg] = 0;
+        nmsg++;
+        segs = 0;
+      }
+
+      /* a resend must not repeat an old piggybacked ACK */
+      if (piggyback) {
+        entry->packet->type = PIGGYBACK;
+        entry->packet->ack = ack.ack;
+        entry->packet->wnd = ack.wnd;
+      }
+      else {
+        entry->packet->type = DAT;
+      }
+
+      /* send packet (as raw bytes matching rudp_packet_t layout) */
+      struct msghdr* hdr = &msgs[nmsg - 1].msg_hdr;
+      if (entry->payload) {
+        iovs[niov++] = (struct iovec) { .iov_base = entry->packet, .iov_len = hdr_size };
+        iovs[niov++] = (struct iovec) { .iov_base = (void*)entry->payload, .iov_len = entry->packetlen };
+        hdr->msg_iovlen += 2;
+      }
+      else {
+        iovs[niov++] = (struct iovec) { .iov_base = entry->packet, .iov_len = hdr_size + entry->packetlen };
+        hdr->msg_iovlen++;
+      }
+      batch[npkt++] = entry;
+      msg_pkts[nmsg - 1]++;
+      segs++;
+      extendable = entry->packetlen == PKT_LEN;
+    }
+    if (nmsg == 0) break;
+
+    for (unsigned int m = 0; m < nmsg; m++) {
+      struct msghdr* hdr = &msgs[m].msg_hdr;
+      if (msg_pkts[m] < 2) continue;
+      hdr->msg_control = ctrl[m];
+      hdr->msg_controllen = sizeof(ctrl[m]);
+      struct cmsghdr* cm = CMSG_FIRSTHDR(hdr);
+      cm->cmsg_level = SOL_UDP;
+      cm->cmsg_type = UDP_SEGMENT;
+      cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+      memcpy(CMSG_DATA(cm), &gso_size, sizeof(gso_size));
+    }
+
+    int sent = (int)nmsg;
+    if (conn->impair) {
+      /* one packet per message; the simulator wants it in one piece */
+      for (unsigned int m = 0; m < nmsg; m++) {
+        const struct msghdr* hdr = &msgs[m].msg_hdr;
+        size_t len = 0;
+        for (size_t v = 0; v < hdr->msg_iovlen; v++) {
+          memcpy(flat + len, hdr->msg_iov[v].iov_base, hdr->msg_iov[v].iov_len);
+          len += hdr->msg_iov[v].iov_len;
+        }
+        impair_send(conn, flat, len);
+      }
+    }
+    else {
+      sent = sendmmsg(conn->sockfd, msgs, nmsg, MSG_DONTWAIT);
+    }
+    if (sent < 0 && conn->udp_offload && (errno == EIO || errno == EINVAL)) {
+      /* the route can't segment for us: fall back to one datagram per packet */
+      conn->udp_offload = 0;
+      i = start;
+      continue;
+    }
+    if (sent <= 0) {
+      /* socket buffer full or a send error: nothing may be in flight to
+         bring the backend back, so schedule the retry */
+      conn->retry_us = now + SEND_RETRY_US;
+      break;
+    }
+
+    unsigned int done = 0;
+    for (int m = 0; m < sent; m++) done += msg_pkts[m];
+    for (unsigned int k = 0; k < done; k++) {
+      swnd_entry_t* entry = batch[k];
+      if (!conn->impair) /* impair_send() traces what it lets through */
+        rudp_trace(TRACE_OUT, conn->sockfd, entry->packet, hdr_size + entry->packetlen, now);
+      entry->last_sent_us = now;
+      entry->sent_once = 1;
+      conn->in_flight++;
+      conn->packets_sent++;
+      conn->bytes_sent += entry->packetlen;
+      if (entry->transmits) conn->retransmits++;
+      if (entry->transmits < UINT8_MAX) entry->transmits++;
+      rudp_timer_arm(conn->timers, &entry->rto_timer, now + conn->rto_us);
+    }
+    if (piggyback && done > 0) {
+      conn->ack_owed = 0;
+      conn->ack_pending = 0;
+    }
+    if ((unsigned int)sent < nmsg) {
+      conn->retry_us = now + SEND_RETRY_US;
       break;
     }
   }
-  pthread_mutex_unlock(&swnd_mutex);
 }
 
-void* rudp_backend(void* unused) {
-  (void)unused;
-  /* ensure window is allocated (thread-safe) */
-  pthread_once(&init_once, initialize_window);
-  if (!send_window) return NULL;
+/* Let the congestion controller react to a loss, at most once per window of
+   data for duplicate-ACK losses. Caller holds conn->lock. */
+static void signal_loss(struct rudp_conn* conn, int kind, uint64_t now) {
+  if (kind == CC_LOSS_FAST && conn->in_recovery) return;
+  conn->in_recovery = 1;
+  conn->recover = conn->snd_max - 1;
+  conn->cc->on_loss(conn, kind, now);
+}
 
-  while (1) {
-    pthread_mutex_lock(&swnd_mutex);
+struct expiry {
+  struct rudp_conn* conn;
+  uint64_t now;
+  unsigned int expired;
+};
 
-    if (swnd_count == 0) {
-      pthread_mutex_unlock(&swnd_mutex);
-      usleep(1000);
-      continue;
+/* A packet's retransmit timer fired. Timers are armed with the RTO of the
+   moment; if the RTO has grown since (backoff), wait out the difference. */
+static void rto_expired(rudp_timer_t* timer, void* arg) {
+  struct expiry* x = arg;
+  swnd_entry_t* entry = (swnd_entry_t*)((char*)timer - offsetof(swnd_entry_t, rto_timer));
+  uint64_t due = entry->last_sent_us + x->conn->rto_us;
+  if (due > x->now) {
+    rudp_timer_arm(x->conn->timers, timer, due);
+    return;
+  }
+  mark_lost(x->conn, entry);
+  x->expired++;
+}
+
+/* Selective repeat: only packets whose own timer expired and that the
+   receiver has not SACKed are resent; the wheel hands over just those. A
+   timeout doubles the RTO until the next clean RTT sample. Caller holds
+   conn->lock. */
+static void handle_timeout(struct rudp_conn* conn, uint64_t now) {
+  struct expiry x = { .conn = conn, .now = now };
+  rudp_wheel_run(conn->timers, now, rto_expired, &x);
+  if (x.expired) {
+    conn->rto_us *= 2;
+    if (conn->rto_us > RTO_MAX_US) conn->rto_us = RTO_MAX_US;
+    signal_loss(conn, CC_LOSS_TIMEOUT, now);
+  }
+}
+
+/* Mark window entries covered by the ACK's SACK blocks so they are not
+   retransmitted. Window entries hold consecutive seqnums, so each block
+   maps straight onto a range of slots. Caller holds conn->lock. */
+static void apply_sack(struct rudp_conn* conn, const rudp_sack_t* sack, uint64_t now) {
+  if (conn->swnd_count == 0) return;
+  uint32_t base = entry_seq(window_at(conn, 0));
+  uint32_t nblocks = sack->nblocks > MAX_SACK ? MAX_SACK : sack->nblocks;
+  for (uint32_t b = 0; b < nblocks; b++) {
+    uint32_t start = le32toh(sack->blocks[b].start), end = le32toh(sack->blocks[b].end);
+    if (SEQ_LT(end, start) || SEQ_LT(end, base)) continue;
+    uint32_t first = SEQ_LT(start, base) ? 0 : start - base;
+    uint32_t last = end - base;
+    if (last >= conn->swnd_count) last = conn->swnd_count - 1;
+    for (uint32_t i = first; i <= last; i++) {
+      swnd_entry_t* entry = window_at(conn, i);
+      if (entry->sacked) continue;
+      sample_entry(conn, entry, now);
+      mark_sacked(conn, entry);
     }
+  }
+}
 
-    /* Get current time */
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    unsigned long now_ms = (unsigned long)tv.tv_sec * 1000UL + (unsigned long)(tv.tv_usec / 1000UL);
+/* The receiver keeps re-ACKing the same point while a hole persists: resend
+   the first unacked packet now rather than waiting for its RTO. Caller
+   holds conn->lock. */
+static void fast_retransmit(struct rudp_conn* conn, uint64_t now) {
+  swnd_entry_t* entry = &conn->window[conn->swnd_tail];
+  if (in_flight(entry)) {
+    mark_lost(conn, entry);
+    signal_loss(conn, CC_LOSS_FAST, now);
+  }
+}
 
-    /* Send all pending, unsent packets in the send_window */
-    for (unsigned int i = 0; i < swnd_count; i++) {
-      unsigned int idx = (swnd_tail + i) % swnd_size;
-      swnd_entry_t* entry = &send_window[idx];
+/* Resize a socket buffer, bounded by the connection's memory ceiling.
+   Small adjustments are skipped so a steady flow doesn't make a syscall
+   every round trip. A listener's connections share its socket, which is
+   only ever grown, to the largest size any of them wants, so one flow
+   cannot shrink it under another. Caller holds conn->lock. */
+void tune_sockbuf(struct rudp_conn* conn, int optname, size_t bytes) {
+  size_t* cur = optname == SO_SNDBUF ? &conn->sndbuf : &conn->rcvbuf;
+  size_t ceiling = window_ceiling(conn);
+  if (bytes > ceiling) bytes = ceiling;
+  if (bytes < SOCKBUF_MIN) bytes = SOCKBUF_MIN;
 
-      if (!entry->packet) continue;
+  struct rudp_listener* l = conn->listener;
+  if (l) {
+    size_t* shared = optname == SO_SNDBUF ? &l->sndbuf : &l->rcvbuf;
+    int val = (int)bytes;
+    if (bytes > *shared + *shared / 8 &&
+        setsockopt(conn->sockfd, SOL_SOCKET, optname, &val, sizeof(val)) == 0)
+      *shared = bytes;
+    *cur = *shared;
+    return;
+  }
 
-      /* find connection info for this socket */
-      struct rudp_conn* conn = NULL;
-      for (int j = 0; j < MAX_SOCKETS; j++) {
-        if (rudp_conns[j].sockfd == entry->socket) { conn = &rudp_conns[j]; break; }
-      }
+  size_t diff = bytes > *cur ? bytes - *cur : *cur - bytes;
+  if (*cur != 0 && diff < *cur / 8) return;
+  int val = (int)bytes;
+  if (setsockopt(conn->sockfd, SOL_SOCKET, optname, &val, sizeof(val)) == 0)
+    *cur = bytes;
+}
 
-      if (conn == NULL || conn->addrlen == 0) continue;
+/* Once per round trip, size the window the sender may fill to twice the
+   bandwidth-delay product: the delivery rate over the round times the
+   smoothed RTT. A window-limited flow thus doubles each round until the
+   path or the congestion window limits it; shrinking is gradual. The
+   socket buffers follow. Caller holds conn->lock. */
+static void autotune_window(struct rudp_conn* conn, unsigned int acked, uint64_t now) {
+  conn->round_delivered += acked;
+  if (conn->round_start_us != 0 && SEQ_LT(conn->last_ack, conn->round_end)) return;
 
-      /* rate-limit retransmits: only resend if >100ms since last send */
-      if (entry->sent_once && entry->last_sent_ms != 0 && now_ms - entry->last_sent_ms < 100) {
-        continue;
+  uint64_t elapsed = now - conn->round_start_us;
+  if (conn->round_start_us != 0 && elapsed > 0 && conn->srtt_us > 0) {
+    uint64_t bdp = (uint64_t)conn->round_delivered * conn->srtt_us / elapsed;
+    uint64_t target = 2 * bdp;
+    unsigned int limit = atomic_load(&conn->wnd_limit);
+    if (target < limit) target = limit - (limit - target) / 4;
+    if (target < swnd_size) target = swnd_size;
+    if (target > conn->wnd_cap) target = conn->wnd_cap;
+
+    if (target != limit) {
+      atomic_store(&conn->wnd_limit, (unsigned int)target);
+      /* a sender blocked on the old limit may proceed */
+      if (target > limit && atomic_exchange(&conn->ring_waiters, 0))
+        futex_wake(&conn->ring_count);
+      tune_sockbuf(conn, SO_SNDBUF, target * DATAGRAM_LEN);
+      if (target * DATAGRAM_LEN > conn->rcvbuf)
+        tune_sockbuf(conn, SO_RCVBUF, target * DATAGRAM_LEN); /* room for the ACK burst */
+    }
+  }
+
+  conn->round_start_us = now;
+  conn->round_end = conn->snd_max;
+  conn->round_delivered = 0;
+}
+
+/* Apply one acknowledgement, an ACK datagram or the header of a PIGGYBACK
+   one, to the window. Caller holds conn->lock. */
+static void process_ack(struct rudp_conn* conn, const char* ackbuf, size_t len, uint64_t now) {
+  const size_t hdr_size = offsetof(rudp_packet_t, payload);
+  if (len < hdr_size) return;
+
+  const rudp_packet_t* hdr = (const rudp_packet_t*)ackbuf;
+  /* data repeating the last ACK is no sign of loss, and its payload is no SACK */
+  int pure = hdr->type == ACK;
+  /* the header names the next seqnum expected; the window works with the
+     last one received */
+  uint32_t ack_seq = le32toh(hdr->ack) - 1;
+  if (SEQ_LT(ack_seq, conn->last_ack)) return; /* overtaken by a later one */
+  conn->peer_wnd = le16toh(hdr->wnd);
+
+  unsigned int acked = release_acked(conn, ack_seq, now);
+  if (acked > 0 || ack_seq != conn->last_ack) {
+    conn->last_ack = ack_seq;
+    conn->dupacks = 0;
+    if (conn->in_recovery && SEQ_LEQ(conn->recover, ack_seq))
+      conn->in_recovery = 0;
+    /* hold the window during fast recovery, but slow-start after a timeout */
+    if (acked > 0 && (!conn->in_recovery || conn->cwnd < conn->ssthresh))
+      conn->cc->on_ack(conn, acked, now);
+    autotune_window(conn, acked, now);
+  }
+  else if (pure && conn->swnd_count > 0) {
+    conn->dupacks_seen++;
+    if (++conn->dupacks == DUPACK_THRESHOLD) fast_retransmit(conn, now);
+  }
+
+  /* extended ACKs carry SACK blocks after the header */
+  if (pure && len >= hdr_size + offsetof(rudp_sack_t, blocks)) {
+    rudp_sack_t sack = {0};
+    size_t sack_len = len - hdr_size < sizeof(sack) ? len - hdr_size : sizeof(sack);
+    memcpy(&sack, ackbuf + hdr_size, sack_len);
+    size_t fit = (sack_len - offsetof(rudp_sack_t, blocks)) / sizeof(sack.blocks[0]);
+    if (sack.nblocks > fit) sack.nblocks = (uint8_t)fit;
+    apply_sack(conn, &sack, now);
+  }
+}
+
+/* Size of the packets the kernel coalesced into a GRO datagram, or the whole
+   datagram when it arrived as sent. */
+size_t gro_segment_size(struct msghdr* msg, size_t len) {
+  for (struct cmsghdr* cm = CMSG_FIRSTHDR(msg); cm != NULL; cm = CMSG_NXTHDR(msg, cm)) {
+    if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+      int seg;
+      memcpy(&seg, CMSG_DATA(cm), sizeof(seg));
+      if (seg > 0) return (size_t)seg;
+    }
+  }
+  return len;
+}
+
+/* Act on one datagram read from a connection's socket: data goes to the
+   receive side, ACKs (piggybacked ones too) to the send window. Returns 1
+   if it was data, which the caller acknowledges. Caller holds conn->lock. */
+static int dispatch_datagram(struct rudp_conn* conn, const char* buf, size_t len, uint64_t now) {
+  /* nothing we send is longer: a bigger segment is not ours to parse */
+  if (!RUDP_HEADER_OK(buf, len) || len > DATAGRAM_LEN) return 0;
+  rudp_trace(TRACE_IN, conn->sockfd, buf, len, now);
+
+  switch ((uint8_t)buf[offsetof(rudp_packet_t, type)]) {
+  case PIGGYBACK:
+    if (conn->window) {
+      process_ack(conn, buf, len, now);
+      ready_conn(conn); /* the window may have room again */
+    }
+    /* fall through */
+  case DAT:
+    receive_data(conn, (const rudp_packet_t*)buf, len);
+    return 1;
+  case ACK:
+    if (conn->window) {
+      process_ack(conn, buf, len, now);
+      ready_conn(conn);
+    }
+    return 0;
+  }
+  return 0;
+}
+
+/* Drain a socket with UDP_GRO on: equal-sized datagrams may arrive glued
+   together. Caller holds conn->lock. */
+static unsigned int receive_coalesced(struct rudp_conn* conn, uint64_t now) {
+  static _Alignas(rudp_packet_t) char buf[GRO_BUF_LEN];
+  char ctrl[CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(uint32_t))];
+  unsigned int data = 0;
+
+  for (;;) {
+    struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+    struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = ctrl,
+      .msg_controllen = sizeof(ctrl),
+    };
+    ssize_t n = recvmsg(conn->sockfd, &msg, MSG_DONTWAIT);
+    if (n <= 0) break;
+    if (msg.msg_flags & MSG_TRUNC) continue; /* cut short: drop it whole */
+
+    size_t seg = gro_segment_size(&msg, (size_t)n);
+    for (size_t off = 0; off < (size_t)n; off += seg)
+      data += dispatch_datagram(conn, buf + off, (size_t)n - off < seg ? (size_t)n - off : seg, now);
+    note_drops(conn, &msg);
+  }
+  return data;
+}
+
+/* Drain every queued datagram on a readable socket, IO_BATCH per
+   recvmmsg() call, and acknowledge the data among them at most once.
+   Caller holds conn->lock. */
+static void receive_datagrams(struct rudp_conn* conn, uint64_t now) {
+  static rudp_packet_t bufs[IO_BATCH];
+  static struct mmsghdr msgs[IO_BATCH];
+  static struct iovec iovs[IO_BATCH];
+  static char ctrl[IO_BATCH][CMSG_SPACE(sizeof(uint32_t))];
+  unsigned int data = 0;
+
+  if (conn->gro) {
+    data = receive_coalesced(conn, now);
+  }
+  else {
+    for (;;) {
+      for (int i = 0; i < IO_BATCH; i++) {
+        iovs[i].iov_base = &bufs[i];
+        iovs[i].iov_len = sizeof(bufs[i]);
+        msgs[i].msg_hdr = (struct msghdr) {
+          .msg_iov = &iovs[i],
+          .msg_iovlen = 1,
+          .msg_control = ctrl[i],
+          .msg_controllen = sizeof(ctrl[i]),
+        };
       }
 
-      /* header size: use offsetof to allow flexible struct layout */
-      const size_t hdr_size = offsetof(rudp_packet_t, payload);
-      size_t send_len = hdr_size + entry->packetlen;
+      int n = recvmmsg(conn->sockfd, msgs, IO_BATCH, MSG_DONTWAIT, NULL);
+      if (n <= 0) break;
+      for (int i = 0; i < n; i++) {
+        if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) continue; /* longer than any packet */
+        data += dispatch_datagram(conn, (const char*)&bufs[i], msgs[i].msg_len, now);
+      }
+      /* the drop counter is cumulative: the newest report is enough */
+      note_drops(conn, &msgs[n - 1].msg_hdr);
+      if (n < IO_BATCH) break;
+    }
+  }
+  if (data) acknowledge(conn, data, now);
+}
 
-      /* send packet (as raw bytes matching rudp_packet_t layout) */
-      sendto(entry->socket, entry->packet, send_len, 0,
-             (struct sockaddr*)&conn->addr, conn->addrlen);
-      entry->last_sent_ms = now_ms;
-      entry->sent_once = 1;
+/* -------------------------  Listening sockets  ------------------------- */
+
+/* The backend is the only reader of a listening socket: it answers SYNs,
+   and routes everything else to the connection of the peer it came from,
+   provided it carries the connection ID the SYN|ACK assigned.
+   It reads the listener's own dup() of the socket, so accepted
+   connections keep receiving after the application closes the listening
+   descriptor. Each accepted connection sends through a dup() as well so
+   it keeps a descriptor of its own. listener->lock guards the ID map
+   and backlog; a connection is only reached through the map, so removing
+   it from there under the lock is what stops routing to it. */
+
+int watch_listener(struct rudp_conn* conn) {
+  pthread_once(&init_once, initialize_backend);
+  if (epoll_fd < 0) return -1;
+
+  /* watched stays 0: the registration belongs to the listener, not to
+     the descriptor release_window() unwatches */
+  struct epoll_event ev = { .events = EPOLLIN };
+  ev.data.ptr = conn;
+  return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->listener->sockfd, &ev);
+}
+
+/* Stop reading the listener's socket and free the listening connection,
+   whose reference keeps the listener's state. Called once, by whoever
+   took l->sockfd under l->lock, with the lock released. */
+static void retire_listener(struct rudp_conn* lconn, int fd) {
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+  close(fd);
+  rudp_conn_put(lconn);
+}
+
+/* Give `conn` the lowest free connection ID. Caller holds l->lock. */
+static int assign_connid(struct rudp_listener* l, struct rudp_conn* conn) {
+  unsigned int id = l->next_id;
+  while (id < l->ids_cap && l->ids[id]) id++;
+  if (id > CONNID_MAX) { errno = EMFILE; return -1; }
+
+  if (id >= l->ids_cap) {
+    unsigned int cap = l->ids_cap ? l->ids_cap * 2 : RXQ_MIN;
+    if (cap > CONNID_MAX + 1) cap = CONNID_MAX + 1;
+    struct rudp_conn** grown = realloc(l->ids, cap * sizeof(*grown));
+    if (!grown) return -1;
+    memset(grown + l->ids_cap, 0, (cap - l->ids_cap) * sizeof(*grown));
+    l->ids = grown;
+    l->ids_cap = cap;
+  }
+  l->ids[id] = conn;
+  l->next_id = id + 1;
+  conn->connid = (uint16_t)id;
+  return 0;
+}
+
+static void schedule_conn(struct rudp_conn* conn, uint64_t due);
+
+/* Take a connection off the list of handshakes in progress. Caller holds
+   l->lock. */
+static void end_handshake(struct rudp_listener* l, struct rudp_conn* conn) {
+  if (conn->syn_us == 0) return;
+  if (conn->prev_syn) conn->prev_syn->next_syn = conn->next_syn;
+  else l->syn_head = conn->next_syn;
+  if (conn->next_syn) conn->next_syn->prev_syn = conn->prev_syn;
+  else l->syn_tail = conn->prev_syn;
+  conn->next_syn = conn->prev_syn = NULL;
+  conn->syn_us = 0;
+}
+
+/* Tear down a connection the application never accepted. */
+static void drop_unaccepted(struct rudp_conn* conn) {
+  int fd = conn->sockfd;
+  pthread_mutex_lock(&conn->lock);
+  release_window(conn);
+  pthread_mutex_unlock(&conn->lock);
+  release_listener(conn);
+  rudp_conn_remove(conn);
+  close(fd);
+}
+
+/* The listening connection's deadline: drop handshakes that never
+   completed, oldest first, and schedule the next expiry. */
+static void expire_handshakes(struct rudp_conn* lconn, uint64_t now) {
+  struct rudp_listener* l = lconn->listener;
+  struct rudp_conn* expired = NULL;
+
+  pthread_mutex_lock(&l->lock);
+  while (l->syn_head && l->syn_head->syn_us + HANDSHAKE_TIMEOUT_US <= now) {
+    struct rudp_conn* conn = l->syn_head;
+    end_handshake(l, conn);
+    conn->next_accept = expired;
+    expired = conn;
+  }
+  uint64_t due = l->syn_head ? l->syn_head->syn_us + HANDSHAKE_TIMEOUT_US : 0;
+  pthread_mutex_unlock(&l->lock);
+  schedule_conn(lconn, due);
+
+  while (expired) {
+    struct rudp_conn* conn = expired;
+    expired = conn->next_accept;
+    drop_unaccepted(conn);
+  }
+}
+
+/* Answer a SYN with a SYN|ACK carrying the peer's connection ID, creating
+   the connection on first sight. A retransmitted SYN gets the same ID.
+   Past BACKLOG_MAX connections the application has yet to accept, new
+   peers are ignored until it catches up; their SYNs are retried. */
+static void accept_syn(struct rudp_conn* lconn, const struct sockaddr* from, socklen_t fromlen,
+                       uint64_t now) {
+  struct rudp_listener* l = lconn->listener;
+  struct rudp_conn* conn = rudp_conn_lookup_addr(l->sockfd, from);
+
+  if (!conn) {
+    if (l->pending >= BACKLOG_MAX) return;
+    int fd = dup(l->sockfd);
+    if (fd < 0) return;
+    conn = save_rudp_conn(fd, l->sockfd, (struct sockaddr*)from, fromlen);
+    if (!conn) { close(fd); return; }
+    if (assign_connid(l, conn) < 0) {
+      rudp_conn_remove(conn);
+      close(fd);
+      return;
     }
+    conn->listener = l;
+    l->refs++;
+    l->pending++;
 
-    pthread_mutex_unlock(&swnd_mutex);
+    /* expired by the listening connection's deadline unless it completes */
+    conn->syn_us = now;
+    conn->prev_syn = l->syn_tail;
+    if (l->syn_tail) l->syn_tail->next_syn = conn;
+    else {
+      l->syn_head = conn;
+      schedule_conn(lconn, now + HANDSHAKE_TIMEOUT_US);
+    }
+    l->syn_tail = conn;
+  }
 
-    /* attempt to receive acknowledgements */
-    pthread_mutex_lock(&swnd_mutex);
-    if (swnd_count > 0) {
-      swnd_entry_t* first_entry = &send_window[swnd_tail];
-      if (first_entry->packet) {
-        /* find connection info for this socket */
-        struct rudp_conn* conn = NULL;
-        for (int j = 0; j < MAX_SOCKETS; j++) {
-          if (rudp_conns[j].sockfd == first_entry->socket) { conn = &rudp_conns[j]; break; }
-        }
+  rudp_packet_t synack = { .version = RUDP_VERSION, .type = SYN | ACK, .connid = htole16(conn->connid) };
+  sendto(l->sockfd, &synack, offsetof(rudp_packet_t, payload), MSG_DONTWAIT, from, fromlen);
+  rudp_trace(TRACE_OUT, conn->sockfd, &synack, offsetof(rudp_packet_t, payload), 0);
+}
 
-        if (conn && conn->addrlen > 0) {
-          const size_t hdr_size = offsetof(rudp_packet_t, payload);
-          char ackbuf[sizeof(rudp_packet_t)];
-          struct sockaddr_storage from;
-          socklen_t fromlen = sizeof(from);
-          
-          pthread_mutex_unlock(&swnd_mutex);
-          ssize_t r = recvfrom(first_entry->socket, ackbuf, hdr_size, 0, (struct sockaddr*)&from, &fromlen);
-          pthread_mutex_lock(&swnd_mutex);
-
-          if (r > 0) {
-            uint8_t ack_type = (uint8_t)ackbuf[offsetof(rudp_packet_t, type)];
-            uint32_t ack_seq = 0;
-            memcpy(&ack_seq, ackbuf + offsetof(rudp_packet_t, seqnum), sizeof(uint32_t));
-            
-            if (ack_type == ACK) {
-              /* Remove all packets up to and including ack_seq */
-              while (swnd_count > 0) {
-                swnd_entry_t* entry = &send_window[swnd_tail];
-                if (entry->packet && entry->packet->seqnum <= ack_seq) {
-                  free(entry->packet);
-                  entry->packet = NULL;
-                  entry->socket = -1;
-                  entry->packetlen = 0;
-                  entry->last_sent_ms = 0;
-                  entry->sent_once = 0;
-                  swnd_tail = (swnd_tail + 1) % swnd_size;
-                  swnd_count--;
-                } else {
-                  break;
-                }
-              }
-            }
-          } else {
-            /* Timeout - mark all packets in window as needing retransmit */
-            for (unsigned int i = 0; i < swnd_count; i++) {
-              unsigned int idx = (swnd_tail + i) % swnd_size;
-              swnd_entry_t* entry = &send_window[idx];
-              if (entry->packet) {
-                entry->sent_once = 0;
-                entry->last_sent_ms = 0;
-              }
-            }
-          }
-        }
+/* Hand a handshaken connection to sans_accept_conn(). Caller holds l->lock. */
+static void queue_accept(struct rudp_listener* l, struct rudp_conn* conn) {
+  end_handshake(l, conn);
+  conn->established = 1;
+  if (l->backlog_tail)
+    l->backlog_tail->next_accept = conn;
+  else
+    l->backlog = conn;
+  l->backlog_tail = conn;
+  pthread_cond_signal(&l->ready);
+}
+
+/* Deliver one datagram from a listening socket. Caller holds l->lock. */
+static void route_datagram(struct rudp_conn* lconn, const struct sockaddr* from, socklen_t fromlen,
+                           const char* buf, size_t len, uint64_t now) {
+  struct rudp_listener* l = lconn->listener;
+  if (!RUDP_HEADER_OK(buf, len)) return;
+
+  const rudp_packet_t* hdr = (const rudp_packet_t*)buf;
+  uint8_t type = hdr->type;
+  uint16_t connid = le16toh(hdr->connid);
+
+  if (type == SYN) {
+    rudp_trace(TRACE_IN, l->sockfd, buf, len, now);
+    if (!l->closed) accept_syn(lconn, from, fromlen, now);
+    return;
+  }
+
+  /* the peer's address picks the connection, its connid must agree; the
+     map decides whether the connection is still open */
+  struct rudp_conn* conn = rudp_conn_lookup_addr(l->sockfd, from);
+  if (!conn || connid >= l->ids_cap || l->ids[connid] != conn) {
+    rudp_trace(TRACE_IN, l->sockfd, buf, len, now);
+    return; /* unknown, closed or spoofed: drop */
+  }
+
+  if (!conn->established) {
+    /* the handshake ACK, or data that overtook a lost one */
+    queue_accept(l, conn);
+    if (type == ACK) {
+      rudp_trace(TRACE_IN, conn->sockfd, buf, len, now);
+      return;
+    }
+  }
+
+  /* a disconnect released its window and is on its way out of the map */
+  pthread_mutex_lock(&conn->lock);
+  if (!atomic_load(&conn->closing) && dispatch_datagram(conn, buf, len, now))
+    acknowledge(conn, 1, now);
+  pthread_mutex_unlock(&conn->lock);
+}
+
+/* Drain a readable listening socket, IO_BATCH datagrams per recvmmsg(). */
+static void receive_listener(struct rudp_conn* lconn, uint64_t now) {
+  static rudp_packet_t bufs[IO_BATCH];
+  static struct sockaddr_storage names[IO_BATCH];
+  static struct mmsghdr msgs[IO_BATCH];
+  static struct iovec iovs[IO_BATCH];
+  struct rudp_listener* l = lconn->listener;
+
+  pthread_mutex_lock(&l->lock);
+  while (l->sockfd >= 0) {
+    for (int i = 0; i < IO_BATCH; i++) {
+      iovs[i].iov_base = &bufs[i];
+      iovs[i].iov_len = sizeof(bufs[i]);
+      msgs[i].msg_hdr = (struct msghdr) {
+        .msg_name = &names[i],
+        .msg_namelen = sizeof(names[i]),
+        .msg_iov = &iovs[i],
+        .msg_iovlen = 1,
+      };
+    }
+
+    int n = recvmmsg(l->sockfd, msgs, IO_BATCH, MSG_DONTWAIT, NULL);
+    if (n <= 0) break;
+    for (int i = 0; i < n; i++)
+      if (!(msgs[i].msg_hdr.msg_flags & MSG_TRUNC))
+        route_datagram(lconn, (struct sockaddr*)&names[i], msgs[i].msg_hdr.msg_namelen,
+                       (const char*)&bufs[i], msgs[i].msg_len, now);
+    if (n < IO_BATCH) break;
+  }
+  pthread_mutex_unlock(&l->lock);
+}
+
+/* Stop accepting on a listening socket and unlink its connection, whose
+   descriptor the caller closes next. Connections the application never
+   accepted are torn down; accepted ones keep receiving through the
+   listener's socket, which is retired with the last of them. */
+void close_listener(struct rudp_conn* lconn) {
+  struct rudp_listener* l = lconn->listener;
+  struct rudp_conn* orphans = NULL;
+  int accepted = 0;
+
+  rudp_conn_unlink(lconn);
+
+  pthread_mutex_lock(&l->lock);
+  l->closed = 1;
+  for (unsigned int id = 1; id < l->ids_cap; id++) {
+    struct rudp_conn* conn = l->ids[id];
+    if (!conn) continue;
+    if (conn->established == 2) {
+      accepted = 1;
+      continue;
+    }
+    l->ids[id] = NULL;
+    conn->next_accept = orphans;
+    orphans = conn;
+  }
+  l->backlog = l->backlog_tail = NULL;
+  int fd = -1;
+  if (!accepted) {
+    fd = l->sockfd;
+    l->sockfd = -1;
+  }
+  pthread_cond_broadcast(&l->ready);
+  pthread_mutex_unlock(&l->lock);
+
+  while (orphans) {
+    struct rudp_conn* conn = orphans;
+    orphans = conn->next_accept;
+    drop_unaccepted(conn);
+  }
+  if (fd >= 0) retire_listener(lconn, fd);
+}
+
+/* Drop a reference to a listener, freeing its state with the last one.
+   Once a closed listener is down to the listening connection's own
+   reference, that connection is retired; its reference goes when it is
+   freed, after the backend's last look at it. Caller holds l->lock, which
+   is released. */
+void put_listener(struct rudp_listener* l) {
+  unsigned int refs = --l->refs;
+  int fd = -1;
+  if (refs == 1 && l->closed && l->sockfd >= 0) {
+    fd = l->sockfd;
+    l->sockfd = -1;
+  }
+  pthread_mutex_unlock(&l->lock);
+
+  if (fd >= 0) retire_listener(l->conn, fd);
+  if (refs == 0) {
+    /* sans_listen() failed before anything took the socket */
+    if (l->sockfd >= 0) close(l->sockfd);
+    pthread_mutex_destroy(&l->lock);
+    pthread_cond_destroy(&l->ready);
+    free(l->ids);
+    free(l);
+  }
+}
+
+/* Drop a connection's reference to its listener. */
+void release_listener(struct rudp_conn* conn) {
+  struct rudp_listener* l = conn->listener;
+  if (!l) return;
+
+  pthread_mutex_lock(&l->lock);
+  unsigned int id = conn->connid;
+  if (!conn->listening && id < l->ids_cap && l->ids[id] == conn) {
+    l->ids[id] = NULL;
+    if (id < l->next_id) l->next_id = id;
+  }
+  if (!conn->listening && conn->established != 2) {
+    end_handshake(l, conn);
+    l->pending--;
+  }
+  conn->listener = NULL;
+  put_listener(l);
+}
+
+/* Arm timer_fd for the given deadline, or disarm it when deadline is 0. */
+static void arm_timer(uint64_t deadline, uint64_t now) {
+  struct itimerspec its = {0};
+  if (deadline != 0) {
+    uint64_t wait = deadline > now ? deadline - now : 0;
+    if (wait == 0) wait = 1; /* a zero it_value would disarm the timer */
+    its.it_value.tv_sec = (time_t)(wait / 1000000);
+    its.it_value.tv_nsec = (long)(wait % 1000000) * 1000L;
+  }
+  timerfd_settime(timer_fd, 0, &its, NULL);
+}
+
+/* Put a connection's timer in the wheel for `due`, or take it out for 0. */
+static void schedule_conn(struct rudp_conn* conn, uint64_t due) {
+  if (due == 0)
+    rudp_timer_cancel(&deadlines, &conn->deadline);
+  else if (!conn->deadline.pprev || conn->deadline.expires_us != due)
+    rudp_timer_arm(&deadlines, &conn->deadline, due);
+}
+
+/* a connection about to be freed leaves the wheel */
+void unschedule_conn(struct rudp_conn* conn) {
+  schedule_conn(conn, 0);
+}
+
+static void deadline_expired(rudp_timer_t* timer, void* arg) {
+  (void)arg;
+  ready_conn((struct rudp_conn*)((char*)timer - offsetof(struct rudp_conn, deadline)));
+}
+
+/* Do what is due on a connection: take new packets, resend expired ones,
+   send what the windows allow and a held ACK whose time has come. Then
+   schedule it for the earliest of its next retransmit, send retry and
+   ACK deadline. Caller holds conn->lock. */
+static void service_conn(struct rudp_conn* conn, uint64_t now) {
+  uint64_t due = 0;
+  if (conn->sockfd < 0 || atomic_load(&conn->closing)) {
+    schedule_conn(conn, 0);
+    return;
+  }
+  if (conn->window) {
+    take_submitted(conn);
+    handle_timeout(conn, now);
+    transmit_pending(conn, now);
+    due = rudp_wheel_next(conn->timers);
+    if (conn->retry_us != 0 && (due == 0 || conn->retry_us < due)) due = conn->retry_us;
+  }
+  if (conn->ack_pending) {
+    /* no data came along to carry the ACK */
+    if (conn->ack_due_us <= now)
+      send_ack(conn);
+    else if (due == 0 || conn->ack_due_us < due)
+      due = conn->ack_due_us;
+  }
+  schedule_conn(conn, due);
+}
+
+/* Service every queued connection. One queued again meanwhile is pushed
+   anew, so it is safe to clear the flag before servicing. */
+static void service_ready(uint64_t now) {
+  struct rudp_conn* conn = atomic_exchange(&ready_head, NULL);
+  while (conn) {
+    struct rudp_conn* next = conn->next_ready;
+    atomic_store(&conn->ready, 0);
+    if (conn->listening) {
+      expire_handshakes(conn, now);
+    }
+    else {
+      pthread_mutex_lock(&conn->lock);
+      service_conn(conn, now);
+      pthread_mutex_unlock(&conn->lock);
+    }
+    conn = next;
+  }
+}
+
+void* rudp_backend(void* unused) {
+  (void)unused;
+  pthread_once(&init_once, initialize_backend);
+  if (epoll_fd < 0) return NULL;
+
+  struct epoll_event events[MAX_EVENTS];
+  while (1) {
+    /* no event or ready entry from the last pass is held any more */
+    rudp_conn_reap();
+
+    int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      perror("epoll_wait");
+      return NULL;
+    }
+    /* senders publishing from here on must signal again */
+    atomic_store(&wake_pending, 0);
+    trace_poll();
+
+    for (int i = 0; i < n; i++) {
+      void* src = events[i].data.ptr;
+      uint64_t count;
+      if (src == &wake_fd || src == &timer_fd) {
+        /* clear the counter; the work is picked up below */
+        if (read(*(int*)src, &count, sizeof(count)) < 0 && errno != EAGAIN)
+          perror("read");
+        continue;
       }
+
+      struct rudp_conn* conn = src;
+      if (conn->listening) {
+        receive_listener(conn, now_us());
+        continue;
+      }
+      pthread_mutex_lock(&conn->lock);
+      if (conn->watched) receive_datagrams(conn, now_us());
+      pthread_mutex_unlock(&conn->lock);
     }
 
-    pthread_mutex_unlock(&swnd_mutex);
-    usleep(1000);
+    /* connections whose deadline passed join those with fresh work */
+    uint64_t now = now_us();
+    rudp_wheel_run(&deadlines, now, deadline_expired, NULL);
+    service_ready(now);
+    uint64_t deadline = rudp_wheel_next(&deadlines);
+
+    /* datagrams held back by an impairment simulation */
+    uint64_t release = impair_flush(now_us());
+    if (release != 0 && (deadline == 0 || release < deadline)) deadline = release;
+    arm_timer(deadline, now);
   }
 
   return NULL;
 }
 
 void init_rudp_backend(void) {
-  /* Initialize send_window early so test harness can access it */
-  pthread_once(&init_once, initialize_window);
+  /* Create the backend's event sources early so senders can signal it */
+  pthread_once(&init_once, initialize_backend);
 }
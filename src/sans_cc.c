@@ -0,0 +1,249 @@
+#include "rudp.h"
+#include <string.h>
+#include <stdint.h>
+
+/*
+ *  Congestion control for the RUDP sender.  Every algorithm works on the
+ *  connection's cwnd/ssthresh (in packets) and keeps anything else it needs
+ *  in conn->cc_priv.  Hooks are called by the backend with conn->lock held.
+ */
+
+#define INIT_CWND 10  /* initial window, as in RFC 6928 */
+#define MIN_CWND 2
+
+static void cc_reset(struct rudp_conn* conn) {
+  conn->cwnd = INIT_CWND;
+  conn->ssthresh = UINT32_MAX;
+  conn->cwnd_cnt = 0;
+  memset(conn->cc_priv, 0, sizeof(conn->cc_priv));
+}
+
+/* exponential growth below ssthresh; returns acked packets left over */
+static unsigned int slow_start(struct rudp_conn* conn, unsigned int acked) {
+  uint32_t cwnd = conn->cwnd + acked;
+  if (cwnd > conn->ssthresh) cwnd = conn->ssthresh;
+  acked -= cwnd - conn->cwnd;
+  conn->cwnd = cwnd;
+  return acked;
+}
+
+/* The window was full when these packets were acknowledged. A sender held
+   back by the application or the receiver never tests a larger cwnd, so
+   it must not grow one. */
+static int cwnd_limited(const struct rudp_conn* conn, unsigned int acked) {
+  return conn->in_flight + acked >= conn->cwnd;
+}
+
+/* grow cwnd by one packet for every `w` packets acknowledged */
+static void additive_increase(struct rudp_conn* conn, uint32_t w, unsigned int acked) {
+  if (w == 0) w = 1;
+  conn->cwnd_cnt += acked;
+  if (conn->cwnd_cnt >= w) {
+    conn->cwnd += conn->cwnd_cnt / w;
+    conn->cwnd_cnt %= w;
+  }
+}
+
+/* ----------------------------  Reno (AIMD)  ---------------------------- */
+
+static void reno_on_ack(struct rudp_conn* conn, unsigned int acked, uint64_t now) {
+  (void)now;
+  if (!cwnd_limited(conn, acked)) return;
+  if (conn->cwnd < conn->ssthresh) {
+    acked = slow_start(conn, acked);
+    if (acked == 0) return;
+  }
+  additive_increase(conn, conn->cwnd, acked);
+}
+
+static void reno_on_loss(struct rudp_conn* conn, int kind, uint64_t now) {
+  (void)now;
+  conn->ssthresh = conn->cwnd / 2 < MIN_CWND ? MIN_CWND : conn->cwnd / 2;
+  conn->cwnd = (kind == CC_LOSS_TIMEOUT) ? 1 : conn->ssthresh;
+  conn->cwnd_cnt = 0;
+}
+
+const rudp_cc_ops_t rudp_cc_reno = {
+  .name = "reno",
+  .init = cc_reset,
+  .on_ack = reno_on_ack,
+  .on_loss = reno_on_loss,
+};
+
+/* ----------------------------  CUBIC (RFC 9438)  ----------------------- */
+
+#define CUBIC_C 0.4
+#define CUBIC_BETA 0.7
+
+struct cubic {
+  double w_max;          /* window just before the last reduction */
+  double k;              /* seconds until the cubic reaches w_max again */
+  double origin;         /* plateau of the current epoch */
+  uint64_t epoch_start;  /* first ACK after the last reduction, 0 if none */
+};
+_Static_assert(sizeof(struct cubic) <= sizeof(((struct rudp_conn*)0)->cc_priv), "cubic state too large");
+
+/* Newton iteration; avoids pulling in libm for cbrt() */
+static double cube_root(double x) {
+  if (x <= 0) return 0;
+  double y = x > 1 ? x / 3 : 1;
+  for (int i = 0; i < 40; i++) {
+    double next = y - (y * y * y - x) / (3 * y * y);
+    if (next == y) break;
+    y = next;
+  }
+  return y;
+}
+
+static void cubic_on_ack(struct rudp_conn* conn, unsigned int acked, uint64_t now) {
+  struct cubic* c = (struct cubic*)conn->cc_priv;
+  if (!cwnd_limited(conn, acked)) return;
+  if (conn->cwnd < conn->ssthresh) {
+    acked = slow_start(conn, acked);
+    if (acked == 0) return;
+  }
+
+  if (c->epoch_start == 0) {
+    c->epoch_start = now;
+    if (conn->cwnd < c->w_max) {
+      c->k = cube_root((c->w_max - conn->cwnd) / CUBIC_C);
+      c->origin = c->w_max;
+    }
+    else {
+      c->k = 0;
+      c->origin = conn->cwnd;
+    }
+  }
+
+  /* target one RTT ahead, but never below what Reno would have reached */
+  double rtt = conn->srtt_us ? conn->srtt_us / 1e6 : 0.1;
+  double t = (now - c->epoch_start) / 1e6 + rtt;
+  double target = CUBIC_C * (t - c->k) * (t - c->k) * (t - c->k) + c->origin;
+  double reno = c->w_max * CUBIC_BETA + 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * (t / rtt);
+  if (reno > target) target = reno;
+
+  uint32_t w;
+  if (target > conn->cwnd)
+    w = (uint32_t)(conn->cwnd / (target - conn->cwnd));
+  else
+    w = 100 * conn->cwnd; /* plateau: grow very slowly */
+  additive_increase(conn, w, acked);
+}
+
+static void cubic_on_loss(struct rudp_conn* conn, int kind, uint64_t now) {
+  (void)now;
+  struct cubic* c = (struct cubic*)conn->cc_priv;
+
+  /* fast convergence: release bandwidth sooner when the plateau is falling */
+  if (conn->cwnd < c->w_max)
+    c->w_max = conn->cwnd * (1 + CUBIC_BETA) / 2;
+  else
+    c->w_max = conn->cwnd;
+  c->epoch_start = 0;
+
+  uint32_t reduced = (uint32_t)(conn->cwnd * CUBIC_BETA);
+  conn->ssthresh = reduced < MIN_CWND ? MIN_CWND : reduced;
+  conn->cwnd = (kind == CC_LOSS_TIMEOUT) ? 1 : conn->ssthresh;
+  conn->cwnd_cnt = 0;
+}
+
+const rudp_cc_ops_t rudp_cc_cubic = {
+  .name = "cubic",
+  .init = cc_reset,
+  .on_ack = cubic_on_ack,
+  .on_loss = cubic_on_loss,
+};
+
+/* ----------------------------  Vegas (delay-based)  -------------------- */
+
+#define VEGAS_ALPHA 2  /* fewer packets queued than this: grow */
+#define VEGAS_BETA 4   /* more packets queued than this: shrink */
+#define VEGAS_GAMMA 1  /* leave slow start once this many are queued */
+
+struct vegas {
+  uint64_t base_rtt;  /* lowest RTT ever seen: the propagation delay */
+  uint64_t min_rtt;   /* lowest RTT during the current round */
+  uint32_t samples;   /* RTT samples during the current round */
+  uint32_t round_end; /* a round ends when this seqnum is acknowledged */
+};
+_Static_assert(sizeof(struct vegas) <= sizeof(((struct rudp_conn*)0)->cc_priv), "vegas state too large");
+
+static void vegas_init(struct rudp_conn* conn) {
+  cc_reset(conn);
+  struct vegas* v = (struct vegas*)conn->cc_priv;
+  v->base_rtt = UINT64_MAX;
+  v->min_rtt = UINT64_MAX;
+  v->round_end = conn->snd_max;
+}
+
+static void vegas_on_rtt(struct rudp_conn* conn, uint64_t rtt, uint64_t now) {
+  (void)now;
+  struct vegas* v = (struct vegas*)conn->cc_priv;
+  if (rtt == 0) rtt = 1;
+  if (rtt < v->base_rtt) v->base_rtt = rtt;
+  if (rtt < v->min_rtt) v->min_rtt = rtt;
+  v->samples++;
+}
+
+/* Once per round trip, compare the expected and actual rates. Their
+   difference, times the base RTT, is the number of our packets queued at
+   the bottleneck. */
+static void vegas_on_ack(struct rudp_conn* conn, unsigned int acked, uint64_t now) {
+  struct vegas* v = (struct vegas*)conn->cc_priv;
+
+  if (SEQ_LT(conn->last_ack, v->round_end)) {
+    if (conn->cwnd < conn->ssthresh && cwnd_limited(conn, acked)) slow_start(conn, acked);
+    return;
+  }
+  v->round_end = conn->snd_max;
+
+  /* too few samples to trust the delay signal */
+  if (v->samples <= 2) {
+    reno_on_ack(conn, acked, now);
+  }
+  else {
+    uint64_t target = (uint64_t)conn->cwnd * v->base_rtt / v->min_rtt;
+    uint32_t queued = conn->cwnd - (uint32_t)target;
+
+    if (conn->cwnd < conn->ssthresh) {
+      if (queued > VEGAS_GAMMA) {
+        /* queue is building: leave slow start below the target */
+        conn->ssthresh = (uint32_t)target + 1 < MIN_CWND ? MIN_CWND : (uint32_t)target + 1;
+        if (conn->cwnd > conn->ssthresh) conn->cwnd = conn->ssthresh;
+      }
+      else if (cwnd_limited(conn, acked)) {
+        slow_start(conn, acked);
+      }
+    }
+    else if (queued > VEGAS_BETA) {
+      if (conn->cwnd > MIN_CWND) conn->cwnd--;
+    }
+    else if (queued < VEGAS_ALPHA && cwnd_limited(conn, acked)) {
+      conn->cwnd++;
+    }
+  }
+
+  v->min_rtt = UINT64_MAX;
+  v->samples = 0;
+}
+
+const rudp_cc_ops_t rudp_cc_vegas = {
+  .name = "vegas",
+  .init = vegas_init,
+  .on_ack = vegas_on_ack,
+  .on_loss = reno_on_loss,
+  .on_rtt = vegas_on_rtt,
+};
+
+/* ----------------------------------------------------------------------- */
+
+const rudp_cc_ops_t* rudp_cc_default = &rudp_cc_cubic;
+
+static const rudp_cc_ops_t* const algorithms[] = { &rudp_cc_reno, &rudp_cc_cubic, &rudp_cc_vegas };
+
+const rudp_cc_ops_t* rudp_cc_find(const char* name) {
+  for (size_t i = 0; i < sizeof(algorithms) / sizeof(algorithms[0]); i++) {
+    if (strcmp(algorithms[i]->name, name) == 0) return algorithms[i];
+  }
+  return NULL;
+}
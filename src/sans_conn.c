@@ -0,0 +1,298 @@
+#include "rudp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <netinet/in.h>
+
+/*
+ *  RUDP connection table.  Connections are allocated individually and
+ *  indexed twice, by socket fd and by (receiving socket, peer address), in
+ *  open addressing tables with linear probing that double once half full.
+ *  A reader-writer lock guards both; connection state itself stays under
+ *  conn->lock.
+ *
+ *  Connections are reference counted: the table holds one reference and
+ *  rudp_conn_lookup() hands out another, which the caller drops with
+ *  rudp_conn_put(), so an application thread's pointer outlives a
+ *  concurrent removal.  The backend looks connections up without a
+ *  reference (an epoll event, its ready list, rudp_conn_lookup_addr()), so
+ *  once a backend runs, the last put leaves the connection to be freed at
+ *  the top of the backend's loop via rudp_conn_reap().
+ */
+
+#define TABLE_MIN 16
+
+struct conn_index {
+  struct rudp_conn** slots;
+  unsigned int mask;    /* capacity - 1; capacity is a power of two */
+};
+
+static pthread_rwlock_t table_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct conn_index by_fd;
+static struct conn_index by_addr;
+static unsigned int conn_count;
+
+static struct rudp_conn* graveyard;  /* removed, waiting for rudp_conn_reap() */
+static int deferred_free;            /* a backend calls rudp_conn_reap() */
+
+static uint32_t hash_fd(int fd) {
+  return (uint32_t)fd * 2654435761u;
+}
+
+/* FNV-1a over the receiving socket and the peer's family, port and address */
+static uint32_t hash_addr(int fd, const struct sockaddr* addr) {
+  uint32_t h = 2166136261u;
+  const uint8_t* p;
+  size_t len;
+
+  if (addr->sa_family == AF_INET6) {
+    const struct sockaddr_in6* in6 = (const struct sockaddr_in6*)addr;
+    h = (h ^ in6->sin6_port) * 16777619u;
+    p = in6->sin6_addr.s6_addr;
+    len = sizeof(in6->sin6_addr);
+  }
+  else {
+    const struct sockaddr_in* in = (const struct sockaddr_in*)addr;
+    h = (h ^ in->sin_port) * 16777619u;
+    p = (const uint8_t*)&in->sin_addr;
+    len = sizeof(in->sin_addr);
+  }
+  for (size_t i = 0; i < len; i++) h = (h ^ p[i]) * 16777619u;
+  return (h ^ (uint32_t)fd) * 16777619u;
+}
+
+static int addr_equal(const struct sockaddr* a, const struct sockaddr* b) {
+  if (a->sa_family != b->sa_family) return 0;
+  if (a->sa_family == AF_INET6) {
+    const struct sockaddr_in6* x = (const struct sockaddr_in6*)a;
+    const struct sockaddr_in6* y = (const struct sockaddr_in6*)b;
+    return x->sin6_port == y->sin6_port &&
+           memcmp(&x->sin6_addr, &y->sin6_addr, sizeof(x->sin6_addr)) == 0;
+  }
+  const struct sockaddr_in* x = (const struct sockaddr_in*)a;
+  const struct sockaddr_in* y = (const struct sockaddr_in*)b;
+  return x->sin_port == y->sin_port && x->sin_addr.s_addr == y->sin_addr.s_addr;
+}
+
+static uint32_t conn_hash(const struct conn_index* idx, const struct rudp_conn* conn) {
+  if (idx == &by_fd) return hash_fd(conn->sockfd);
+  return hash_addr(conn->rx_fd, (const struct sockaddr*)&conn->addr);
+}
+
+static void index_insert(struct conn_index* idx, struct rudp_conn* conn) {
+  uint32_t i = conn_hash(idx, conn) & idx->mask;
+  while (idx->slots[i]) i = (i + 1) & idx->mask;
+  idx->slots[i] = conn;
+}
+
+/* Backward-shift deletion: pull later entries of the probe run into the
+   hole so lookups never need tombstones. */
+static void index_remove(struct conn_index* idx, struct rudp_conn* conn) {
+  uint32_t i = conn_hash(idx, conn) & idx->mask;
+  while (idx->slots[i] != conn) {
+    if (!idx->slots[i]) return;
+    i = (i + 1) & idx->mask;
+  }
+
+  uint32_t hole = i;
+  for (;;) {
+    i = (i + 1) & idx->mask;
+    struct rudp_conn* next = idx->slots[i];
+    if (!next) break;
+    uint32_t home = conn_hash(idx, next) & idx->mask;
+    /* `next` may fill the hole only if its home slot is not in (hole, i] */
+    if (((i - home) & idx->mask) >= ((i - hole) & idx->mask)) {
+      idx->slots[hole] = next;
+      hole = i;
+    }
+  }
+  idx->slots[hole] = NULL;
+}
+
+/* Double both indexes once they would pass half full. Caller holds the
+   write lock. */
+static int reserve(unsigned int count) {
+  unsigned int cap = by_fd.slots ? by_fd.mask + 1 : 0;
+  if (count * 2 <= cap) return 0;
+
+  unsigned int grown = cap ? cap * 2 : TABLE_MIN;
+  struct rudp_conn** fds = calloc(grown, sizeof(*fds));
+  struct rudp_conn** addrs = calloc(grown, sizeof(*addrs));
+  if (!fds || !addrs) {
+    free(fds);
+    free(addrs);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  struct rudp_conn** old = by_fd.slots;
+  free(by_addr.slots);
+  by_fd = (struct conn_index) { .slots = fds, .mask = grown - 1 };
+  by_addr = (struct conn_index) { .slots = addrs, .mask = grown - 1 };
+  for (unsigned int i = 0; i < cap; i++) {
+    if (!old[i]) continue;
+    index_insert(&by_fd, old[i]);
+    index_insert(&by_addr, old[i]);
+  }
+  free(old);
+  return 0;
+}
+
+/* The connection on `sockfd`, with a reference the caller must put. */
+struct rudp_conn* rudp_conn_lookup(int sockfd) {
+  if (sockfd < 0) return NULL;
+  struct rudp_conn* found = NULL;
+
+  pthread_rwlock_rdlock(&table_lock);
+  if (by_fd.slots) {
+    for (uint32_t i = hash_fd(sockfd) & by_fd.mask; by_fd.slots[i]; i = (i + 1) & by_fd.mask) {
+      if (by_fd.slots[i]->sockfd == sockfd) {
+        found = by_fd.slots[i];
+        atomic_fetch_add(&found->refs, 1);
+        break;
+      }
+    }
+  }
+  pthread_rwlock_unlock(&table_lock);
+  return found;
+}
+
+/* The connection whose datagrams from `addr` arrive on socket `rx_fd`.
+   Backend only: no reference is taken, the graveyard keeps it valid. */
+struct rudp_conn* rudp_conn_lookup_addr(int rx_fd, const struct sockaddr* addr) {
+  struct rudp_conn* found = NULL;
+
+  pthread_rwlock_rdlock(&table_lock);
+  if (by_addr.slots) {
+    uint32_t i = hash_addr(rx_fd, addr) & by_addr.mask;
+    for (; by_addr.slots[i]; i = (i + 1) & by_addr.mask) {
+      struct rudp_conn* conn = by_addr.slots[i];
+      if (conn->rx_fd == rx_fd && addr_equal((const struct sockaddr*)&conn->addr, addr)) {
+        found = conn;
+        break;
+      }
+    }
+  }
+  pthread_rwlock_unlock(&table_lock);
+  return found;
+}
+
+static void free_conn(struct rudp_conn* conn) {
+  /* a listening socket's state lives until its last connection is gone */
+  if (conn->listening) release_listener(conn);
+  unschedule_conn(conn);
+  pthread_mutex_destroy(&conn->rxq.lock);
+  pthread_cond_destroy(&conn->rxq.nonempty);
+  free(conn->rxq.slots);
+  free(conn->reorder);
+  pthread_mutex_destroy(&conn->lock);
+  free(conn);
+}
+
+/* Track a new connection on `sockfd` whose datagrams arrive on `rx_fd`
+   from `addr` (NULL for a listening socket). */
+struct rudp_conn* save_rudp_conn(int sockfd, int rx_fd, struct sockaddr* addr, socklen_t addrlen) {
+  struct rudp_conn* conn = calloc(1, sizeof(*conn));
+  if (!conn) return NULL;
+  pthread_mutex_init(&conn->lock, NULL);
+  pthread_mutex_init(&conn->rxq.lock, NULL);
+  pthread_cond_init(&conn->rxq.nonempty, NULL);
+  if (addr) memcpy(&conn->addr, addr, addrlen);
+  conn->addrlen = addr ? addrlen : 0;
+  conn->sockfd = sockfd;
+  conn->rx_fd = rx_fd;
+  atomic_store(&conn->refs, 1);
+  conn->ack_every = ACK_EVERY;
+  conn->ack_delay_us = ACK_DELAY_US;
+
+  pthread_rwlock_wrlock(&table_lock);
+  if (reserve(conn_count + 1) < 0) {
+    pthread_rwlock_unlock(&table_lock);
+    free_conn(conn);
+    return NULL;
+  }
+  index_insert(&by_fd, conn);
+  index_insert(&by_addr, conn);
+  conn_count++;
+  pthread_rwlock_unlock(&table_lock);
+
+  /* report receive-queue drops so SO_RCVBUF can be grown */
+  int on = 1;
+  setsockopt(rx_fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on));
+  return conn;
+}
+
+/* Unlink a connection from every index, after which its descriptor may
+   be closed and reused. */
+void rudp_conn_unlink(struct rudp_conn* conn) {
+  pthread_rwlock_wrlock(&table_lock);
+  index_remove(&by_fd, conn);
+  index_remove(&by_addr, conn);
+  conn_count--;
+  pthread_rwlock_unlock(&table_lock);
+}
+
+/* Free an unlinked connection, or leave it for rudp_conn_reap() while the
+   backend may still hold a pointer to it. */
+static void retire_conn(struct rudp_conn* conn) {
+  pthread_rwlock_wrlock(&table_lock);
+  if (deferred_free) {
+    conn->next_dead = graveyard;
+    graveyard = conn;
+    conn = NULL;
+  }
+  pthread_rwlock_unlock(&table_lock);
+
+  if (conn) free_conn(conn);
+}
+
+/* Drop a reference; the last one frees the connection, which by then is
+   unlinked. */
+void rudp_conn_put(struct rudp_conn* conn) {
+  if (atomic_fetch_sub(&conn->refs, 1) == 1) retire_conn(conn);
+}
+
+/* Unlink a connection and drop the table's reference. The caller has
+   already released its window and stopped the backend watching its
+   socket. */
+void rudp_conn_remove(struct rudp_conn* conn) {
+  rudp_conn_unlink(conn);
+  rudp_conn_put(conn);
+}
+
+/* Free removed connections. Called by the backend when it holds no
+   connection pointers; the first call switches removal to deferred. One
+   still on the ready list waits for the pass that takes it off. */
+void rudp_conn_reap(void) {
+  struct rudp_conn* dead;
+  struct rudp_conn* queued = NULL;
+
+  pthread_rwlock_wrlock(&table_lock);
+  deferred_free = 1;
+  dead = graveyard;
+  graveyard = NULL;
+  pthread_rwlock_unlock(&table_lock);
+
+  while (dead) {
+    struct rudp_conn* next = dead->next_dead;
+    if (atomic_load(&dead->ready)) {
+      dead->next_dead = queued;
+      queued = dead;
+    }
+    else {
+      free_conn(dead);
+    }
+    dead = next;
+  }
+
+  if (!queued) return;
+  pthread_rwlock_wrlock(&table_lock);
+  while (queued) {
+    struct rudp_conn* next = queued->next_dead;
+    queued->next_dead = graveyard;
+    graveyard = queued;
+    queued = next;
+  }
+  pthread_rwlock_unlock(&table_lock);
+}
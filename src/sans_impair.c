@@ -0,0 +1,245 @@
+#include "rudp.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "include/sans.h"
+
+/*
+ *  Network impairment simulator (SANS_OPT_IMPAIR).  Datagrams a connection
+ *  sends pass through here instead of going straight to the socket: they
+ *  may be dropped (independently or in Gilbert-Elliott bursts), duplicated,
+ *  queued behind a rate-limited bottleneck link, and delayed with jitter or
+ *  held back to reorder them.  Every decision comes from a per-connection
+ *  PRNG, so a seed reproduces the same impairment.  Delayed datagrams wait
+ *  in one release-time heap that the backend flushes as they come due.
+ *  Per-connection state is guarded by conn->lock, the heap by heap_lock.
+ */
+
+#define REORDER_HOLD_US 1000 /* default extra delay of a reordered datagram */
+
+struct rudp_impair {
+  struct sans_impair cfg;
+  uint64_t rng;           /* xorshift64* state */
+  unsigned char in_burst; /* Gilbert-Elliott: currently in the lossy state */
+  uint64_t link_free_us;  /* when the simulated bottleneck finishes its backlog */
+};
+
+/* a datagram waiting for its release time */
+struct delayed {
+  uint64_t release_us;
+  uint64_t order;         /* FIFO among equal release times */
+  struct rudp_conn* conn;
+  size_t len;
+  uint8_t data[];
+};
+
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct delayed** heap;
+static unsigned int heap_count;
+static unsigned int heap_cap;
+static uint64_t heap_order;
+
+static uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000UL + (uint64_t)(ts.tv_nsec / 1000L);
+}
+
+static uint64_t next_random(struct rudp_impair* im) {
+  im->rng ^= im->rng >> 12;
+  im->rng ^= im->rng << 25;
+  im->rng ^= im->rng >> 27;
+  return im->rng * 2685821657736338717ULL;
+}
+
+/* uniform in [0, 1) */
+static double chance(struct rudp_impair* im) {
+  return (double)(next_random(im) >> 11) / (double)(1ULL << 53);
+}
+
+static int valid_probability(double p) {
+  return p >= 0.0 && p <= 1.0;
+}
+
+/* Install, replace or (with an all-zero configuration) remove a
+   connection's impairment. Caller holds conn->lock. */
+int impair_configure(struct rudp_conn* conn, const struct sans_impair* cfg) {
+  if (!valid_probability(cfg->loss) || !valid_probability(cfg->burst_enter) ||
+      !valid_probability(cfg->burst_exit) || !valid_probability(cfg->reorder) ||
+      !valid_probability(cfg->duplicate)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  static const struct sans_impair none;
+  if (memcmp(cfg, &none, sizeof(none)) == 0) {
+    free(conn->impair);
+    conn->impair = NULL;
+    return 0;
+  }
+
+  struct rudp_impair* im = conn->impair;
+  if (!im) {
+    im = calloc(1, sizeof(*im));
+    if (!im) return -1;
+    conn->impair = im;
+  }
+  im->cfg = *cfg;
+  /* splitmix64 of the seed: never zero, and nearby seeds diverge at once */
+  uint64_t z = (uint64_t)cfg->seed + 0x9e3779b97f4a7c15ULL;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  im->rng = (z ^ (z >> 31)) | 1;
+  im->in_burst = 0;
+  im->link_free_us = 0;
+  return 0;
+}
+
+static int heap_before(const struct delayed* a, const struct delayed* b) {
+  if (a->release_us != b->release_us) return a->release_us < b->release_us;
+  return a->order < b->order;
+}
+
+static void sift_up(unsigned int i) {
+  while (i > 0) {
+    unsigned int parent = (i - 1) / 2;
+    if (!heap_before(heap[i], heap[parent])) break;
+    struct delayed* tmp = heap[i];
+    heap[i] = heap[parent];
+    heap[parent] = tmp;
+    i = parent;
+  }
+}
+
+static void sift_down(unsigned int i) {
+  for (;;) {
+    unsigned int least = i, l = 2 * i + 1, r = 2 * i + 2;
+    if (l < heap_count && heap_before(heap[l], heap[least])) least = l;
+    if (r < heap_count && heap_before(heap[r], heap[least])) least = r;
+    if (least == i) break;
+    struct delayed* tmp = heap[i];
+    heap[i] = heap[least];
+    heap[least] = tmp;
+    i = least;
+  }
+}
+
+static void schedule(struct rudp_conn* conn, const void* buf, size_t len, uint64_t release) {
+  struct delayed* d = malloc(sizeof(*d) + len);
+  if (!d) return; /* as good as lost */
+  d->release_us = release;
+  d->conn = conn;
+  d->len = len;
+  memcpy(d->data, buf, len);
+
+  pthread_mutex_lock(&heap_lock);
+  if (heap_count == heap_cap) {
+    unsigned int cap = heap_cap ? heap_cap * 2 : 64;
+    struct delayed** grown = realloc(heap, cap * sizeof(*grown));
+    if (!grown) {
+      pthread_mutex_unlock(&heap_lock);
+      free(d);
+      return;
+    }
+    heap = grown;
+    heap_cap = cap;
+  }
+  d->order = heap_order++;
+  heap[heap_count++] = d;
+  sift_up(heap_count - 1);
+  pthread_mutex_unlock(&heap_lock);
+}
+
+/* the datagram leaves for real: only now is it traced as sent. The
+   backend never blocks on it; a full socket buffer is one more loss */
+static void transmit(struct rudp_conn* conn, const void* buf, size_t len, uint64_t now) {
+  sendto(conn->sockfd, buf, len, MSG_DONTWAIT, (struct sockaddr*)&conn->addr, conn->addrlen);
+  rudp_trace(TRACE_OUT, conn->sockfd, buf, len, now);
+}
+
+/* Send one datagram through the connection's impairment. Copies are
+   traced as they leave, so a dropped datagram never shows up as sent.
+   Caller holds conn->lock. */
+void impair_send(struct rudp_conn* conn, const void* buf, size_t len) {
+  struct rudp_impair* im = conn->impair;
+  const struct sans_impair* cfg = &im->cfg;
+  uint64_t now = now_us();
+
+  /* bursty loss: a two-state chain that drops everything while "bad" */
+  if (im->in_burst) {
+    if (chance(im) < cfg->burst_exit) im->in_burst = 0;
+    else return;
+  }
+  else if (cfg->burst_enter > 0 && chance(im) < cfg->burst_enter) {
+    im->in_burst = 1;
+    return;
+  }
+  if (cfg->loss > 0 && chance(im) < cfg->loss) return;
+
+  int copies = cfg->duplicate > 0 && chance(im) < cfg->duplicate ? 2 : 1;
+  for (int i = 0; i < copies; i++) {
+    uint64_t depart = now;
+    if (cfg->rate_kbps) {
+      /* serialize onto the bottleneck; tail-drop once its buffer is full */
+      if (im->link_free_us > depart) depart = im->link_free_us;
+      uint64_t backlog = (depart - now) * cfg->rate_kbps / 8000;
+      if (cfg->queue_bytes && backlog + len > cfg->queue_bytes) continue;
+      depart += (uint64_t)len * 8000 / cfg->rate_kbps;
+      im->link_free_us = depart;
+    }
+
+    uint64_t release = depart + cfg->delay_us;
+    if (cfg->jitter_us) release += next_random(im) % ((uint64_t)cfg->jitter_us + 1);
+    if (cfg->reorder > 0 && chance(im) < cfg->reorder)
+      release += cfg->reorder_us ? cfg->reorder_us : REORDER_HOLD_US;
+
+    if (release <= now)
+      transmit(conn, buf, len, now);
+    else
+      schedule(conn, buf, len, release);
+  }
+}
+
+/* Send every delayed datagram that is due. Returns the release time of the
+   next one, or 0 if none wait. Called by the backend. */
+uint64_t impair_flush(uint64_t now) {
+  uint64_t next = 0;
+  pthread_mutex_lock(&heap_lock);
+  while (heap_count > 0) {
+    struct delayed* d = heap[0];
+    if (d->release_us > now) {
+      next = d->release_us;
+      break;
+    }
+    heap[0] = heap[--heap_count];
+    sift_down(0);
+    transmit(d->conn, d->data, d->len, now);
+    free(d);
+  }
+  pthread_mutex_unlock(&heap_lock);
+  return next;
+}
+
+/* Drop a closing connection's impairment and the datagrams it still has
+   waiting. Caller holds conn->lock. */
+void impair_release(struct rudp_conn* conn) {
+  free(conn->impair);
+  conn->impair = NULL;
+
+  pthread_mutex_lock(&heap_lock);
+  unsigned int kept = 0;
+  for (unsigned int i = 0; i < heap_count; i++) {
+    if (heap[i]->conn == conn)
+      free(heap[i]);
+    else
+      heap[kept++] = heap[i];
+  }
+  if (kept != heap_count) {
+    heap_count = kept;
+    for (unsigned int i = heap_count / 2; i-- > 0;) sift_down(i);
+  }
+  pthread_mutex_unlock(&heap_lock);
+}
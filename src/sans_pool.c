@@ -0,0 +1,63 @@
+#include "rudp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/*
+ *  Fixed-size packet pool backing a connection's send window.  Buffers are
+ *  carved from one cache-line aligned region, one per window slot, and
+ *  stay with their slot until the window is released, so enqueueing and
+ *  acknowledging a packet never reaches the allocator.  The region is
+ *  sized for the window's ceiling; pages are only touched once the slot
+ *  owning them is first written.  Callers serialize access (conn->lock).
+ */
+
+#define CACHE_LINE 64
+#define HUGE_PAGE (2UL * 1024 * 1024)
+
+/* stride between buffers: whole cache lines so neighbours never share one */
+#define POOL_STRIDE ((sizeof(rudp_packet_t) + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1))
+
+static void* map_region(size_t* bytes, int hugepages) {
+  void* base = MAP_FAILED;
+  if (hugepages) {
+    size_t rounded = (*bytes + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+    base = mmap(NULL, rounded, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (base != MAP_FAILED) {
+      *bytes = rounded;
+      return base;
+    }
+  }
+
+  /* page-aligned, hence cache-line aligned; fall back here when no
+     hugetlbfs pages are reserved and let THP promote it if it can */
+  base = mmap(NULL, *bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED) return NULL;
+  if (hugepages) madvise(base, *bytes, MADV_HUGEPAGE);
+  return base;
+}
+
+int rudp_pool_init(rudp_pool_t* pool, unsigned int count, int hugepages) {
+  size_t bytes = (size_t)count * POOL_STRIDE;
+  uint8_t* base = map_region(&bytes, hugepages);
+  if (!base) { perror("mmap"); return -1; }
+
+  pool->base = base;
+  pool->bytes = bytes;
+  pool->count = count;
+  pool->carved = 0;
+  return 0;
+}
+
+void rudp_pool_destroy(rudp_pool_t* pool) {
+  if (pool->base) munmap(pool->base, pool->bytes);
+  memset(pool, 0, sizeof(*pool));
+}
+
+/* the next untouched buffer, front to back; NULL once all are handed out */
+rudp_packet_t* rudp_pool_get(rudp_pool_t* pool) {
+  if (pool->carved == pool->count) return NULL;
+  return (rudp_packet_t*)((uint8_t*)pool->base + (size_t)pool->carved++ * POOL_STRIDE);
+}
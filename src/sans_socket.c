@@ -6,22 +6,13 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <sys/select.h>
 #include <sys/time.h>
+#include <pthread.h>
 #include "rudp.h"
 #include "include/sans.h"
 
-/* Define MAX_SOCKETS locally to avoid include dependency issues */
-#ifndef MAX_SOCKETS
-#define MAX_SOCKETS 10
-#endif
-
-/* `struct rudp_conn` and `rudp_conns` are declared in the header; define the
-   actual array here (header provides the type). */
-struct rudp_conn rudp_conns[MAX_SOCKETS];
-
-int save_rudp_conn(int sockfd, struct sockaddr *addr, socklen_t addrlen);
-
 int sans_connect(const char* host, int port, int protocol) {
     // --- TCP behavior (unchanged)
     if (protocol == IPPROTO_TCP) {
@@ -76,27 +67,42 @@ int sans_connect(const char* host, int port, int protocol) {
         setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
 
         // Begin 3-way handshake
-        rudp_packet_t syn = {SYN, 0};
+        rudp_packet_t syn = {.version = RUDP_VERSION, .type = SYN};
         rudp_packet_t synack;
-        rudp_packet_t ack = {ACK, 0};
+        rudp_packet_t ack = {.version = RUDP_VERSION, .type = ACK};
+        const size_t hdr_len = offsetof(rudp_packet_t, payload);
         struct sockaddr_storage from;
         socklen_t fromlen = sizeof(from);
 
         // Send SYN
-        sendto(sockfd, &syn, sizeof(rudp_packet_t), 0, res->ai_addr, res->ai_addrlen);
+        sendto(sockfd, &syn, hdr_len, 0, res->ai_addr, res->ai_addrlen);
+        rudp_trace(TRACE_OUT, sockfd, &syn, hdr_len, 0);
 
         // Retransmit on failure
         int retries = 3;
         for (int i = 0; i < retries; i++) {
             ssize_t n = recvfrom(sockfd, &synack, sizeof(rudp_packet_t), 0, (struct sockaddr *)&from, &fromlen);
-            if (n > 0 && synack.type == (SYN | ACK)) {
-                // Send final ACK
-                sendto(sockfd, &ack, sizeof(rudp_packet_t), 0, (struct sockaddr *)&from, fromlen);
-                save_rudp_conn(sockfd, (struct sockaddr *)&from, fromlen);
+            if (n > 0)
+                rudp_trace(TRACE_IN, sockfd, &synack, (size_t)n, 0);
+            if (n > 0 && RUDP_HEADER_OK(&synack, n) && synack.type == (SYN | ACK)) {
+                // Send final ACK, echoing the connection ID a listener assigned
+                ack.connid = synack.connid;
+                sendto(sockfd, &ack, hdr_len, 0, (struct sockaddr *)&from, fromlen);
+                rudp_trace(TRACE_OUT, sockfd, &ack, hdr_len, 0);
+                struct rudp_conn* conn = save_rudp_conn(sockfd, sockfd, (struct sockaddr *)&from, fromlen);
+                if (!conn)
+                    break;
+                conn->connid = le16toh(synack.connid);
+                // From here on the backend reads the socket
+                if (watch_socket(conn) < 0) {
+                    rudp_conn_remove(conn);
+                    break;
+                }
                 return sockfd;
             }
             if (i < retries - 1) {
-                sendto(sockfd, &syn, sizeof(rudp_packet_t), 0, res->ai_addr, res->ai_addrlen);
+                sendto(sockfd, &syn, hdr_len, 0, res->ai_addr, res->ai_addrlen);
+                rudp_trace(TRACE_OUT, sockfd, &syn, hdr_len, 0);
             }
         }
 
@@ -109,6 +115,40 @@ int sans_connect(const char* host, int port, int protocol) {
     return -1;
 }
 
+/* UDP socket bound to iface:port for the RUDP server side. */
+static int bind_rudp(const char* iface, int port) {
+    char port_str[16];
+    snprintf(port_str, sizeof(port_str), "%d", port);
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_PASSIVE;
+    hints.ai_protocol = IPPROTO_UDP;
+
+    if (getaddrinfo(iface, port_str, &hints, &res) != 0)
+        return -1;
+
+    int sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (sockfd < 0) {
+        freeaddrinfo(res);
+        return -1;
+    }
+
+    if (bind(sockfd, res->ai_addr, res->ai_addrlen) < 0) {
+        close(sockfd);
+        freeaddrinfo(res);
+        return -1;
+    }
+
+    freeaddrinfo(res);
+
+    struct timeval tv = {1, 0};
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return sockfd;
+}
+
 int sans_accept(const char* iface, int port, int protocol) {
     if (protocol == IPPROTO_TCP) {
         char port_str[16];
@@ -151,54 +191,43 @@ int sans_accept(const char* iface, int port, int protocol) {
 
     /* -------------------------- RUDP BEHAVIOR -------------------------- */
     else if (protocol == IPPROTO_RUDP) {
-        char port_str[16];
-        snprintf(port_str, sizeof(port_str), "%d", port);
-
-        struct addrinfo hints, *res;
-        memset(&hints, 0, sizeof(hints));
-        hints.ai_family = AF_UNSPEC;
-        hints.ai_socktype = SOCK_DGRAM;
-        hints.ai_flags = AI_PASSIVE;
-        hints.ai_protocol = IPPROTO_UDP;
-
-        if (getaddrinfo(iface, port_str, &hints, &res) != 0)
-            return -1;
-
-        int sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-        if (sockfd < 0) {
-            freeaddrinfo(res);
-            return -1;
-        }
-
-        if (bind(sockfd, res->ai_addr, res->ai_addrlen) < 0) {
-            close(sockfd);
-            freeaddrinfo(res);
+        int sockfd = bind_rudp(iface, port);
+        if (sockfd < 0)
             return -1;
-        }
 
-        freeaddrinfo(res);
-
-        struct timeval tv = {1, 0};
-        setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-
-        rudp_packet_t syn, synack = {SYN | ACK, 0}, ack;
+        rudp_packet_t syn, synack = {.version = RUDP_VERSION, .type = SYN | ACK}, ack;
+        const size_t hdr_len = offsetof(rudp_packet_t, payload);
         struct sockaddr_storage client_addr;
         socklen_t addrlen = sizeof(client_addr);
 
         for (;;) {
             ssize_t n = recvfrom(sockfd, &syn, sizeof(syn), 0,
                                  (struct sockaddr *)&client_addr, &addrlen);
-            if (n < 0 || syn.type != SYN)
+            if (n > 0)
+                rudp_trace(TRACE_IN, sockfd, &syn, (size_t)n, 0);
+            if (n < 0 || !RUDP_HEADER_OK(&syn, n) || syn.type != SYN)
                 continue; // ignore bad packets
 
             while (1) {
-                sendto(sockfd, &synack, sizeof(synack), 0,
+                sendto(sockfd, &synack, hdr_len, 0,
                        (struct sockaddr *)&client_addr, addrlen);
+                rudp_trace(TRACE_OUT, sockfd, &synack, hdr_len, 0);
 
                 n = recvfrom(sockfd, &ack, sizeof(ack), 0,
                              (struct sockaddr *)&client_addr, &addrlen);
-                if (n > 0 && ack.type == ACK) {
-                    save_rudp_conn(sockfd, (struct sockaddr *)&client_addr, addrlen);
+                if (n > 0)
+                    rudp_trace(TRACE_IN, sockfd, &ack, (size_t)n, 0);
+                if (n > 0 && RUDP_HEADER_OK(&ack, n) && ack.type == ACK) {
+                    struct rudp_conn* conn = save_rudp_conn(sockfd, sockfd, (struct sockaddr *)&client_addr, addrlen);
+                    if (!conn) {
+                        close(sockfd);
+                        return -1;
+                    }
+                    if (watch_socket(conn) < 0) {
+                        rudp_conn_remove(conn);
+                        close(sockfd);
+                        return -1;
+                    }
                     return sockfd;
                 }
             }
@@ -212,31 +241,252 @@ int sans_accept(const char* iface, int port, int protocol) {
     return -1;
 }
 
+/* Open a listening RUDP socket that serves many peers on one port. The
+   backend reads it, answers handshakes and routes each datagram by its
+   connection ID; sans_accept_conn() returns the connections. */
+int sans_listen(const char* iface, int port, int protocol) {
+    if (protocol != IPPROTO_RUDP) {
+        errno = EPROTONOSUPPORT;
+        return -1;
+    }
+
+    int sockfd = bind_rudp(iface, port);
+    if (sockfd < 0)
+        return -1;
+
+    // The backend reads a dup() of its own, which outlives sockfd while
+    // accepted connections remain
+    struct rudp_listener* l = calloc(1, sizeof(*l));
+    int rx_fd = l ? dup(sockfd) : -1;
+    struct rudp_conn* conn = rx_fd >= 0 ? save_rudp_conn(sockfd, rx_fd, NULL, 0) : NULL;
+    if (!conn) {
+        if (rx_fd >= 0)
+            close(rx_fd);
+        free(l);
+        close(sockfd);
+        return -1;
+    }
+    l->sockfd = rx_fd;
+    l->conn = conn;
+    l->next_id = 1;
+    l->refs = 1;
+    pthread_mutex_init(&l->lock, NULL);
+    pthread_cond_init(&l->ready, NULL);
+    conn->listener = l;
+    conn->listening = 1;
+
+    if (watch_listener(conn) < 0) {
+        rudp_conn_remove(conn);
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+/* Wait for the next connection to complete its handshake with a listening
+   socket. The returned socket is used like one from sans_accept(). */
+int sans_accept_conn(int listener) {
+    struct rudp_conn* lconn = rudp_conn_lookup(listener);
+    if (!lconn || !lconn->listening) {
+        if (lconn)
+            rudp_conn_put(lconn);
+        errno = EINVAL;
+        return -1;
+    }
+
+    // A reference keeps the listener's state alive while we wait, even if
+    // the listening socket is closed and its connections go meanwhile
+    struct rudp_listener* l = lconn->listener;
+    pthread_mutex_lock(&l->lock);
+    l->refs++;
+    while (!l->backlog && !l->closed)
+        pthread_cond_wait(&l->ready, &l->lock);
+    if (!l->backlog) {
+        put_listener(l);
+        rudp_conn_put(lconn);
+        errno = EBADF;
+        return -1;
+    }
+    struct rudp_conn* conn = l->backlog;
+    l->backlog = conn->next_accept;
+    if (!l->backlog)
+        l->backlog_tail = NULL;
+    conn->next_accept = NULL;
+    conn->established = 2;
+    l->pending--;
+    int sockfd = conn->sockfd;
+    put_listener(l);
+    rudp_conn_put(lconn);
+    return sockfd;
+}
 
 int sans_disconnect(int socket) {
-    for (int i = 0; i < MAX_SOCKETS; i++) {
-        if (rudp_conns[i].sockfd == socket) {
-            rudp_conns[i].sockfd = -1;
-            memset(&rudp_conns[i].addr, 0, sizeof(struct sockaddr_storage));
-            rudp_conns[i].addrlen = 0;
+    struct rudp_conn* conn = rudp_conn_lookup(socket);
+    if (conn) {
+        /* give the backend a chance to deliver what is still queued */
+        drain_window(conn);
+        pthread_mutex_lock(&conn->lock);
+        release_window(conn);
+        pthread_mutex_unlock(&conn->lock);
+        if (conn->listening) {
+            // freed by the listener once its accepted connections are gone
+            close_listener(conn);
+        }
+        else {
+            if (conn->listener)
+                release_listener(conn);
+            rudp_conn_remove(conn);
         }
+        rudp_conn_put(conn);
     }
     return close(socket);
 }
 
-int save_rudp_conn(int sockfd, struct sockaddr *addr, socklen_t addrlen) {
-    static int initialized = 0;
-    if (!initialized) {
-        for (int i = 0; i < MAX_SOCKETS; i++) rudp_conns[i].sockfd = -1;
-        initialized = 1;
+/* Apply one option to `conn`, which the caller holds a reference to. */
+static int set_option(struct rudp_conn* conn, int socket, int option, const void* value, int len) {
+    switch (option) {
+    case SANS_OPT_CC: {
+        char name[16];
+        if (value == NULL || len <= 0 || len >= (int)sizeof(name)) {
+            errno = EINVAL;
+            return -1;
+        }
+        memcpy(name, value, len);
+        name[len] = '\0';
+
+        const rudp_cc_ops_t* cc = rudp_cc_find(name);
+        if (!cc) {
+            errno = ENOENT;
+            return -1;
+        }
+        pthread_mutex_lock(&conn->lock);
+        conn->cc = cc;
+        if (conn->window) cc->init(conn); /* switching mid-flow restarts from slow start */
+        pthread_mutex_unlock(&conn->lock);
+        return 0;
+    }
+    case SANS_OPT_HUGEPAGES:
+        if (value == NULL || len != (int)sizeof(int)) {
+            errno = EINVAL;
+            return -1;
+        }
+        pthread_mutex_lock(&conn->lock);
+        conn->hugepages = *(const int*)value != 0;
+        pthread_mutex_unlock(&conn->lock);
+        return 0;
+
+    case SANS_OPT_UDP_OFFLOAD: {
+        if (value == NULL || len != (int)sizeof(int)) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (conn->listener) {
+            /* the backend reads a shared listening socket one datagram at a time */
+            errno = EOPNOTSUPP;
+            return -1;
+        }
+        int on = *(const int*)value != 0;
+        if (on) {
+            /* probe: kernels without UDP GSO reject the option outright */
+            int gso = 0;
+            socklen_t gsolen = sizeof(gso);
+            if (getsockopt(socket, SOL_UDP, UDP_SEGMENT, &gso, &gsolen) < 0)
+                return -1;
+        }
+        if (setsockopt(socket, SOL_UDP, UDP_GRO, &on, sizeof(on)) < 0)
+            return -1;
+
+        pthread_mutex_lock(&conn->lock);
+        conn->gro = on;
+        conn->udp_offload = on;
+        pthread_mutex_unlock(&conn->lock);
+        return 0;
+    }
+    case SANS_OPT_IMPAIR: {
+        if (value == NULL || len != (int)sizeof(struct sans_impair)) {
+            errno = EINVAL;
+            return -1;
+        }
+        pthread_mutex_lock(&conn->lock);
+        int rc = impair_configure(conn, value);
+        pthread_mutex_unlock(&conn->lock);
+        return rc;
     }
-    for (int i = 0; i < MAX_SOCKETS; i++) {
-        if (rudp_conns[i].sockfd == -1) {
-            rudp_conns[i].sockfd = sockfd;
-            memcpy(&rudp_conns[i].addr, addr, addrlen);
-            rudp_conns[i].addrlen = addrlen;
-            return 0;
+    case SANS_OPT_ACK: {
+        if (value == NULL || len != (int)sizeof(struct sans_ack)) {
+            errno = EINVAL;
+            return -1;
+        }
+        const struct sans_ack* ack = value;
+        if (ack->every == 0 || ack->delay_us > ACK_DELAY_MAX_US) {
+            errno = EINVAL;
+            return -1;
+        }
+        pthread_mutex_lock(&conn->lock);
+        conn->ack_every = ack->every;
+        conn->ack_delay_us = ack->delay_us;
+        pthread_mutex_unlock(&conn->lock);
+        return 0;
+    }
+    case SANS_OPT_WINDOW_MAX:
+        if (value == NULL || len != (int)sizeof(int) || *(const int*)value <= 0) {
+            errno = EINVAL;
+            return -1;
         }
+        pthread_mutex_lock(&conn->lock);
+        conn->wnd_max_bytes = (size_t)*(const int*)value;
+        pthread_mutex_unlock(&conn->lock);
+        return 0;
     }
+
+    errno = ENOPROTOOPT;
     return -1;
 }
+
+int sans_setopt(int socket, int option, const void* value, int len) {
+    struct rudp_conn* conn = rudp_conn_lookup(socket);
+    if (!conn) {
+        errno = ENOTCONN;
+        return -1;
+    }
+    int rc = set_option(conn, socket, option, value, len);
+    rudp_conn_put(conn);
+    return rc;
+}
+
+/* Snapshot a connection's transport counters and congestion state. */
+int sans_get_stats(int socket, struct sans_stats* stats) {
+    struct rudp_conn* conn = rudp_conn_lookup(socket);
+    if (!conn) {
+        errno = ENOTCONN;
+        return -1;
+    }
+    if (stats == NULL) {
+        rudp_conn_put(conn);
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    pthread_mutex_lock(&conn->lock);
+    stats->packets_sent = conn->packets_sent;
+    stats->bytes_sent = conn->bytes_sent;
+    stats->retransmits = conn->retransmits;
+    stats->dupacks = conn->dupacks_seen;
+    stats->ooo_dropped = conn->ooo_dropped;
+    stats->rxq_dropped = conn->rxq_dropped;
+    stats->acks_sent = conn->acks_sent;
+    stats->srtt_us = (unsigned int)conn->srtt_us;
+    stats->rttvar_us = (unsigned int)conn->rttvar_us;
+    stats->rto_us = (unsigned int)conn->rto_us;
+    if (conn->window) {
+        stats->queued = atomic_load(&conn->ring_count);
+        stats->in_flight = conn->in_flight;
+        stats->window = atomic_load(&conn->wnd_limit);
+        stats->cwnd = conn->cwnd;
+    }
+    pthread_mutex_unlock(&conn->lock);
+    stats->blocked_us = atomic_load_explicit(&conn->blocked_us, memory_order_relaxed);
+    rudp_conn_put(conn);
+    return 0;
+}
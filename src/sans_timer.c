@@ -0,0 +1,177 @@
+#include "rudp.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ *  Hierarchical timer wheel for retransmit and connection deadlines.  Time advances in
+ *  ticks of 2^WHEEL_TICK_SHIFT microseconds; level 0 has one slot per tick,
+ *  and each higher level's slots span a whole turn of the level below.  A
+ *  timer sits in the level its distance calls for and moves down as the
+ *  wheel turns, so arming and cancelling are O(1) and running the wheel
+ *  only touches timers that are due.  Per-level occupancy bitmaps find the
+ *  next deadline without walking slots.  Callers serialize access
+ *  (conn->lock, or the backend thread owning the wheel).
+ */
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define LEVEL_SHIFT(level) ((level) * WHEEL_BITS)
+#define WHEEL_SPAN (1ULL << (WHEEL_LEVELS * WHEEL_BITS)) /* ticks the wheel can hold */
+
+void rudp_wheel_init(rudp_wheel_t* wheel, uint64_t now_us) {
+  memset(wheel, 0, sizeof(*wheel));
+  wheel->tick = now_us >> WHEEL_TICK_SHIFT;
+}
+
+/* first tick at or after `us`, so a timer never fires early */
+static uint64_t tick_of(uint64_t us) {
+  return (us + (1ULL << WHEEL_TICK_SHIFT) - 1) >> WHEEL_TICK_SHIFT;
+}
+
+static void link_timer(rudp_wheel_t* wheel, rudp_timer_t* timer, uint64_t tick) {
+  if (tick < wheel->tick) tick = wheel->tick;
+  uint64_t delta = tick - wheel->tick;
+  if (delta >= WHEEL_SPAN) {
+    /* parked in the farthest slot; re-armed from there when it comes due */
+    delta = WHEEL_SPAN - 1;
+    tick = wheel->tick + delta;
+  }
+
+  unsigned int level = 0;
+  while (level + 1 < WHEEL_LEVELS && delta >= (1ULL << LEVEL_SHIFT(level + 1))) level++;
+  unsigned int slot = (unsigned int)(tick >> LEVEL_SHIFT(level)) & WHEEL_MASK;
+
+  rudp_timer_t** head = &wheel->slots[level][slot];
+  timer->next = *head;
+  if (*head) (*head)->pprev = &timer->next;
+  timer->pprev = head;
+  *head = timer;
+  wheel->occupied[level] |= 1ULL << slot;
+}
+
+static void unlink_timer(rudp_timer_t* timer) {
+  *timer->pprev = timer->next;
+  if (timer->next) timer->next->pprev = timer->pprev;
+  timer->pprev = NULL;
+  timer->next = NULL;
+}
+
+/* clear a slot's occupancy bit once its list is empty */
+static void note_slot(rudp_wheel_t* wheel, unsigned int level, unsigned int slot) {
+  if (!wheel->slots[level][slot]) wheel->occupied[level] &= ~(1ULL << slot);
+}
+
+/* The slot a timer heads, or -1 when it is not first in its slot (and
+   removing it cannot empty the slot). */
+static int slot_of(rudp_wheel_t* wheel, const rudp_timer_t* timer, unsigned int* level) {
+  for (unsigned int l = 0; l < WHEEL_LEVELS; l++) {
+    rudp_timer_t** base = wheel->slots[l];
+    if (timer->pprev >= base && timer->pprev < base + WHEEL_SLOTS) {
+      *level = l;
+      return (int)(timer->pprev - base);
+    }
+  }
+  return -1;
+}
+
+void rudp_timer_arm(rudp_wheel_t* wheel, rudp_timer_t* timer, uint64_t expires_us) {
+  if (timer->pprev) rudp_timer_cancel(wheel, timer);
+  timer->expires_us = expires_us;
+  link_timer(wheel, timer, tick_of(expires_us));
+  wheel->count++;
+}
+
+void rudp_timer_cancel(rudp_wheel_t* wheel, rudp_timer_t* timer) {
+  if (!timer->pprev) return;
+  unsigned int level = 0;
+  int slot = slot_of(wheel, timer, &level);
+  unlink_timer(timer);
+  if (slot >= 0) note_slot(wheel, level, (unsigned int)slot);
+  wheel->count--;
+}
+
+/* Move the timers of a higher-level slot down to where they now belong. */
+static void cascade(rudp_wheel_t* wheel, unsigned int level, unsigned int slot) {
+  rudp_timer_t* timer = wheel->slots[level][slot];
+  wheel->slots[level][slot] = NULL;
+  wheel->occupied[level] &= ~(1ULL << slot);
+  while (timer) {
+    rudp_timer_t* next = timer->next;
+    timer->pprev = NULL;
+    link_timer(wheel, timer, tick_of(timer->expires_us));
+    timer = next;
+  }
+}
+
+/* The next tick with anything to do: a due level 0 slot, or the turn at
+   which a higher level cascades. Returns 0 with no timers armed. */
+static uint64_t next_tick(const rudp_wheel_t* wheel) {
+  if (wheel->count == 0) return 0;
+  uint64_t best = 0;
+  for (unsigned int level = 0; level < WHEEL_LEVELS; level++) {
+    uint64_t bits = wheel->occupied[level];
+    if (!bits) continue;
+    unsigned int shift = LEVEL_SHIFT(level);
+    unsigned int cur = (unsigned int)(wheel->tick >> shift) & WHEEL_MASK;
+    /* rotate so the current slot is bit 0; the lowest set bit is the next slot */
+    uint64_t rotated = cur ? (bits >> cur) | (bits << (WHEEL_SLOTS - cur)) : bits;
+    /* past the start of its turn, a higher level's current slot has been
+       cascaded already and only holds timers a full turn ahead */
+    if (level > 0 && (wheel->tick & ((1ULL << shift) - 1))) rotated &= ~1ULL;
+    unsigned int ahead = rotated ? (unsigned int)__builtin_ctzll(rotated) : WHEEL_SLOTS;
+    uint64_t tick = ((wheel->tick >> shift) + ahead) << shift;
+    if (tick < wheel->tick) tick = wheel->tick;
+    if (best == 0 || tick < best) best = tick;
+  }
+  return best;
+}
+
+uint64_t rudp_wheel_next(const rudp_wheel_t* wheel) {
+  uint64_t tick = next_tick(wheel);
+  return tick ? tick << WHEEL_TICK_SHIFT : 0;
+}
+
+/* Advance the wheel to `now_us`, calling `fire` for each timer that came
+   due. A fired timer is disarmed first, so the callback may re-arm it. */
+void rudp_wheel_run(rudp_wheel_t* wheel, uint64_t now_us,
+                    void (*fire)(rudp_timer_t* timer, void* arg), void* arg) {
+  uint64_t target = now_us >> WHEEL_TICK_SHIFT;
+  while (wheel->tick <= target) {
+    if (wheel->count == 0) {
+      wheel->tick = target + 1;
+      break;
+    }
+    /* skip straight to the next tick that has work */
+    uint64_t next = next_tick(wheel);
+    if (next > target) {
+      wheel->tick = target + 1;
+      break;
+    }
+    if (next > wheel->tick) wheel->tick = next;
+
+    /* entering a new turn of a level pulls the matching slot above down */
+    for (unsigned int level = 1; level < WHEEL_LEVELS; level++) {
+      if (wheel->tick & ((1ULL << LEVEL_SHIFT(level)) - 1)) break;
+      cascade(wheel, level, (unsigned int)(wheel->tick >> LEVEL_SHIFT(level)) & WHEEL_MASK);
+    }
+
+    unsigned int slot = (unsigned int)wheel->tick & WHEEL_MASK;
+    rudp_timer_t* timer = wheel->slots[0][slot];
+    wheel->slots[0][slot] = NULL;
+    wheel->occupied[0] &= ~(1ULL << slot);
+    wheel->tick++;
+    while (timer) {
+      rudp_timer_t* next_timer = timer->next;
+      timer->pprev = NULL;
+      timer->next = NULL;
+      if (timer->expires_us > now_us) {
+        /* parked beyond the wheel's span: not due yet */
+        link_timer(wheel, timer, tick_of(timer->expires_us));
+      }
+      else {
+        wheel->count--;
+        fire(timer, arg);
+      }
+      timer = next_timer;
+    }
+  }
+}
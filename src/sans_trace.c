@@ -0,0 +1,258 @@
+#include "rudp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "include/sans.h"
+
+/*
+ *  Packet trace.  Every RUDP datagram sent or received is recorded in a
+ *  ring owned by the thread that handled it: the owner is the only writer,
+ *  so recording is a few stores and a release of the ring's head, with no
+ *  lock or shared cache line.  Rings are registered once per thread and
+ *  outlive it; a thread that exits leaves its ring for the next new thread
+ *  to take over, so recent history survives and memory stays bounded by
+ *  the number of live threads.
+ *
+ *  sans_trace_dump() merges every ring by time into a pcap file with a
+ *  private link type (LINKTYPE_USER0), one struct trace_wire per packet.
+ *  A reader races the writers, so it keeps only the records a writer
+ *  cannot have been overwriting while they were copied.
+ */
+
+#define TRACE_SLOTS 4096      /* records per thread; a power of two */
+#define LINKTYPE_USER0 147
+
+struct trace_record {
+  uint64_t ts_us;             /* CLOCK_MONOTONIC */
+  uint32_t seqnum;
+  int32_t sockfd;
+  uint16_t len;               /* datagram bytes, header included */
+  uint16_t connid;
+  uint8_t type;
+  uint8_t dir;                /* TRACE_IN or TRACE_OUT */
+};
+
+struct trace_ring {
+  _Atomic uint64_t head;      /* records ever written; written by the owner only */
+  atomic_int live;            /* owned by a running thread */
+  struct trace_ring* next;    /* registration list */
+  struct trace_record slots[TRACE_SLOTS];
+};
+
+/* pcap packet data, in the byte order the file header's magic reveals */
+struct trace_wire {
+  uint8_t dir;
+  uint8_t type;
+  uint16_t connid;
+  uint32_t seqnum;
+  uint32_t len;
+  int32_t sockfd;
+};
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_ring* rings;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static _Thread_local struct trace_ring* my_ring;
+
+static char dump_path[256];
+static atomic_int dump_requested;
+
+static uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000UL + (uint64_t)(ts.tv_nsec / 1000L);
+}
+
+/* the owner exited: its ring may be adopted, history and all */
+static void retire_ring(void* ring) {
+  atomic_store(&((struct trace_ring*)ring)->live, 0);
+}
+
+static void create_key(void) {
+  pthread_key_create(&ring_key, retire_ring);
+}
+
+static struct trace_ring* claim_ring(void) {
+  pthread_once(&key_once, create_key);
+
+  pthread_mutex_lock(&rings_lock);
+  struct trace_ring* ring = rings;
+  while (ring && atomic_load(&ring->live)) ring = ring->next;
+  if (ring) {
+    atomic_store(&ring->live, 1);
+  }
+  else if ((ring = calloc(1, sizeof(*ring))) != NULL) {
+    atomic_store(&ring->live, 1);
+    ring->next = rings;
+    rings = ring;
+  }
+  pthread_mutex_unlock(&rings_lock);
+
+  if (ring) pthread_setspecific(ring_key, ring);
+  return ring;
+}
+
+/* Record one datagram of `len` bytes starting with an rudp_packet_t
+   header. `now` is the caller's clock reading, or 0 to take one here. */
+void rudp_trace(int dir, int sockfd, const void* pkt, size_t len, uint64_t now) {
+  struct trace_ring* ring = my_ring;
+  if (!ring && !(ring = my_ring = claim_ring())) return;
+  if (len < offsetof(rudp_packet_t, payload)) return;
+
+  const rudp_packet_t* hdr = pkt;
+  uint64_t idx = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  struct trace_record* rec = &ring->slots[idx & (TRACE_SLOTS - 1)];
+  rec->ts_us = now ? now : now_us();
+  rec->seqnum = le32toh(hdr->seqnum);
+  rec->sockfd = sockfd;
+  rec->len = len > UINT16_MAX ? UINT16_MAX : (uint16_t)len;
+  rec->connid = le16toh(hdr->connid);
+  rec->type = hdr->type;
+  rec->dir = (uint8_t)dir;
+  atomic_store_explicit(&ring->head, idx + 1, memory_order_release);
+}
+
+struct collected {
+  struct trace_record rec;
+  uint64_t order;             /* ring and position: keeps equal timestamps in order */
+};
+
+static int collected_before(const void* a, const void* b) {
+  const struct collected* x = a;
+  const struct collected* y = b;
+  if (x->rec.ts_us != y->rec.ts_us) return x->rec.ts_us < y->rec.ts_us ? -1 : 1;
+  return x->order < y->order ? -1 : x->order > y->order;
+}
+
+/* Copy a ring's surviving records to `out`, returning how many. */
+static unsigned int copy_ring(struct trace_ring* ring, unsigned int ring_no, struct collected* out) {
+  uint64_t end = atomic_load_explicit(&ring->head, memory_order_acquire);
+  uint64_t start = end > TRACE_SLOTS ? end - TRACE_SLOTS : 0;
+  for (uint64_t i = start; i < end; i++) {
+    out[i - start].rec = ring->slots[i & (TRACE_SLOTS - 1)];
+    out[i - start].order = ((uint64_t)ring_no << 48) | (i - start);
+  }
+
+  /* whatever the writer reached meanwhile (plus the slot it may be in the
+     middle of) was overwritten under us */
+  atomic_thread_fence(memory_order_acquire);
+  uint64_t now = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  uint64_t valid = now + 1 > TRACE_SLOTS ? now + 1 - TRACE_SLOTS : 0;
+  if (valid <= start) return (unsigned int)(end - start);
+  if (valid >= end) return 0;
+  unsigned int skip = (unsigned int)(valid - start);
+  memmove(out, out + skip, (end - valid) * sizeof(*out));
+  return (unsigned int)(end - valid);
+}
+
+static int write_pcap(FILE* f, const struct collected* recs, unsigned int n) {
+  struct {
+    uint32_t magic;
+    uint16_t major, minor;
+    int32_t thiszone;
+    uint32_t sigfigs, snaplen, linktype;
+  } file_hdr = { 0xa1b2c3d4, 2, 4, 0, 0, sizeof(struct trace_wire), LINKTYPE_USER0 };
+  if (fwrite(&file_hdr, sizeof(file_hdr), 1, f) != 1) return -1;
+
+  /* pcap wants wall-clock time; records hold the monotonic clock */
+  struct timespec mono, real;
+  clock_gettime(CLOCK_MONOTONIC, &mono);
+  clock_gettime(CLOCK_REALTIME, &real);
+  int64_t offset = ((int64_t)real.tv_sec - mono.tv_sec) * 1000000 + (real.tv_nsec - mono.tv_nsec) / 1000;
+
+  for (unsigned int i = 0; i < n; i++) {
+    const struct trace_record* rec = &recs[i].rec;
+    uint64_t ts = (uint64_t)((int64_t)rec->ts_us + offset);
+    struct { uint32_t sec, usec, incl_len, orig_len; } pkt_hdr = {
+      (uint32_t)(ts / 1000000), (uint32_t)(ts % 1000000),
+      sizeof(struct trace_wire), sizeof(struct trace_wire),
+    };
+    struct trace_wire wire = {
+      .dir = rec->dir,
+      .type = rec->type,
+      .connid = rec->connid,
+      .seqnum = rec->seqnum,
+      .len = rec->len,
+      .sockfd = rec->sockfd,
+    };
+    if (fwrite(&pkt_hdr, sizeof(pkt_hdr), 1, f) != 1 || fwrite(&wire, sizeof(wire), 1, f) != 1)
+      return -1;
+  }
+  return 0;
+}
+
+/* Write every thread's recorded packets, oldest first, to a pcap file. */
+int sans_trace_dump(const char* path) {
+  if (path == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  pthread_mutex_lock(&rings_lock);
+  unsigned int nrings = 0;
+  for (struct trace_ring* ring = rings; ring; ring = ring->next) nrings++;
+  struct collected* recs = malloc(((size_t)nrings * TRACE_SLOTS + 1) * sizeof(*recs));
+  if (!recs) {
+    pthread_mutex_unlock(&rings_lock);
+    return -1;
+  }
+  unsigned int n = 0, ring_no = 0;
+  for (struct trace_ring* ring = rings; ring; ring = ring->next)
+    n += copy_ring(ring, ring_no++, recs + n);
+  pthread_mutex_unlock(&rings_lock);
+
+  qsort(recs, n, sizeof(*recs), collected_before);
+
+  FILE* f = fopen(path, "wb");
+  if (!f) {
+    free(recs);
+    return -1;
+  }
+  int rc = write_pcap(f, recs, n);
+  if (fclose(f) != 0) rc = -1;
+  free(recs);
+  return rc;
+}
+
+/* Dumping is not async-signal-safe, so the handler only asks the backend
+   to do it. */
+static void on_trace_signal(int signo) {
+  (void)signo;
+  atomic_store(&dump_requested, 1);
+  wake_backend();
+}
+
+/* Dump the trace to `path` whenever `signo` arrives. */
+int sans_trace_on_signal(int signo, const char* path) {
+  if (path == NULL || strlen(path) >= sizeof(dump_path)) {
+    errno = EINVAL;
+    return -1;
+  }
+  init_rudp_backend();
+  pthread_mutex_lock(&rings_lock);
+  strcpy(dump_path, path);
+  pthread_mutex_unlock(&rings_lock);
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_trace_signal;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  return sigaction(signo, &sa, NULL);
+}
+
+/* Carry out a dump a signal asked for. Called by the backend. */
+void trace_poll(void) {
+  if (!atomic_exchange(&dump_requested, 0)) return;
+  char path[sizeof(dump_path)];
+  pthread_mutex_lock(&rings_lock);
+  memcpy(path, dump_path, sizeof(path));
+  pthread_mutex_unlock(&rings_lock);
+  if (sans_trace_dump(path) < 0) perror("sans_trace_dump");
+}
@@ -4,78 +4,435 @@
 #include <unistd.h>
 #include <errno.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "include/sans.h"
 
-/* Define MAX_SOCKETS locally to avoid include dependency issues */
-#ifndef MAX_SOCKETS
-#define MAX_SOCKETS 10
-#endif
+#define READAHEAD_BYTES (1024 * 1024) /* how far ahead of the sender file pages are prefetched */
 
-/* enqueue a packet for sending (blocks if send_window is full) */
+/* enqueue a packet for sending (blocks while the connection's window is full).
+   Single producer: one sending thread per socket, see sans.h */
 int sans_send_pkt(int socket, const char* buf, int len) {
-    enqueue_packet(socket, (const uint8_t*)buf, (size_t)len);
+    if (enqueue_packet(socket, (const uint8_t*)buf, (size_t)len) < 0)
+        return -1;
     return len;
 }
 
-/* receive a rudp packet and ACK it. Returns number of payload bytes copied. */
-int sans_recv_pkt(int socket, char* buf, int len) {
-    struct sockaddr_storage from;
-    socklen_t fromlen = sizeof(from);
-    rudp_packet_t pkt;
-
-    ssize_t n = recvfrom(socket, &pkt, sizeof(rudp_packet_t), 0, (struct sockaddr*)&from, &fromlen);
-    if (n <= 0) return (int)n;
-
-    /* compute payload length */
-    size_t hdr_size_dbg = offsetof(rudp_packet_t, payload);
-    int payload_len_dbg = (int)n - (int)hdr_size_dbg;
-    if (payload_len_dbg < 0) payload_len_dbg = 0;
-
-    /* ensure the packet came from the stored connection */
-    for (int i = 0; i < MAX_SOCKETS; i++) {
-        if (rudp_conns[i].sockfd == socket) {
-            /* Skip address validation for now to focus on recv data correctness */
+/* Drop n packets' references to a zero-copy send; the last one hands the
+   buffer back. status -1 marks the send as not fully delivered. */
+void zc_release(struct rudp_zc* zc, unsigned int n, int status) {
+    if (status < 0) atomic_store(&zc->status, -1);
+    if (atomic_fetch_sub(&zc->refs, n) != n) return;
+    if (zc->done) zc->done(zc->buf, zc->ctx, atomic_load(&zc->status));
+    if (zc->map) munmap(zc->map, zc->map_len);
+    free(zc);
+}
+
+/* Queue `len` bytes of `buf` as packets referencing it. The zc holds one
+   reference per packet from the start, so early ACKs cannot complete the
+   send while the rest is still being queued. With `readahead`, pages of
+   a mapped file are requested ahead of the sender. Returns the bytes
+   queued, short if the connection failed part way, or -1 (zc freed) if
+   none were. */
+static long queue_zc(int socket, const char* buf, long len, struct rudp_zc* zc, int readahead) {
+    unsigned long npkts = (unsigned long)((len + PKT_LEN - 1) / PKT_LEN);
+    atomic_init(&zc->refs, (unsigned int)npkts);
+    atomic_init(&zc->status, 0);
+
+    long queued = 0, hinted = 0;
+    for (unsigned long i = 0; i < npkts; i++) {
+        if (readahead && queued >= hinted - READAHEAD_BYTES / 2 && hinted < len) {
+            long start = hinted;
+            hinted = start + READAHEAD_BYTES < len ? start + READAHEAD_BYTES : len;
+            /* madvise() wants a page-aligned start */
+            uintptr_t from = (uintptr_t)(buf + start) & ~(uintptr_t)(sysconf(_SC_PAGESIZE) - 1);
+            madvise((void*)from, (size_t)((uintptr_t)(buf + hinted) - from), MADV_WILLNEED);
+        }
+        long chunk = len - queued < PKT_LEN ? len - queued : PKT_LEN;
+        if (enqueue_zc(socket, (const uint8_t*)buf + queued, (size_t)chunk, zc) < 0) {
+            if (queued == 0) {
+                if (zc->map) munmap(zc->map, zc->map_len);
+                free(zc);
+                return -1;
+            }
+            zc_release(zc, (unsigned int)(npkts - i), -1);
             break;
         }
+        queued += chunk;
+    }
+    return queued;
+}
+
+/* send `len` bytes without copying them: each packet references its slice
+   of `buf` until it is acknowledged, then done(buf, ctx, status) runs once
+   (see sans_zc_done). `buf` must stay valid and unchanged until then.
+   Returns the bytes queued, short if the connection failed part way;
+   done() is only called if that is more than 0. */
+int sans_send_zc(int socket, const char* buf, int len, sans_zc_done done, void* ctx) {
+    if (buf == NULL || len <= 0 || done == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct rudp_zc* zc = calloc(1, sizeof(*zc));
+    if (!zc)
+        return -1;
+    zc->done = done;
+    zc->ctx = ctx;
+    zc->buf = buf;
+    return (int)queue_zc(socket, buf, len, zc, 0);
+}
+
+/* send `len` bytes of file `fd` from `offset` straight out of a shared
+   mapping: window entries point into the mapped pages, which are sliced
+   into packets at each (re)transmission and unmapped once the last one is
+   acknowledged. `fd` may be closed as soon as this returns, but the file
+   must not shrink before the data is acknowledged. A `len` past the end of
+   the file is cut short. Returns the bytes queued, or -1 with nothing
+   queued, e.g. when `socket` is not an RUDP connection. */
+long sans_send_file(int socket, int fd, long offset, long len) {
+    struct stat st;
+    if (offset < 0 || len < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct rudp_conn* conn = rudp_conn_lookup(socket);
+    if (!conn) {
+        errno = ENOTCONN;
+        return -1;
+    }
+    rudp_conn_put(conn); /* each packet looks the connection up again */
+    if (fstat(fd, &st) < 0)
+        return -1;
+    if (!S_ISREG(st.st_mode) || offset > (long)st.st_size) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (len > (long)st.st_size - offset)
+        len = (long)st.st_size - offset;
+    if (len == 0)
+        return 0;
+
+    /* the mapping must start on a page boundary */
+    long page = sysconf(_SC_PAGESIZE);
+    long base = offset & ~(page - 1);
+    size_t map_len = (size_t)(offset - base + len);
+    void* map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, (off_t)base);
+    if (map == MAP_FAILED)
+        return -1;
+    madvise(map, map_len, MADV_SEQUENTIAL);
+
+    struct rudp_zc* zc = calloc(1, sizeof(*zc));
+    if (!zc) {
+        munmap(map, map_len);
+        return -1;
     }
-    if (pkt.type == DAT) {
-        size_t hdr_size = offsetof(rudp_packet_t, payload);
-        int payload_len = (int)n - (int)hdr_size;
-        if (payload_len < 0) payload_len = 0;
-        int to_copy = payload_len > len ? len : payload_len;
-        
-        /* Always send ACK for DAT packets */
-        char ackbuf[offsetof(rudp_packet_t, payload)];
-        memset(ackbuf, 0, sizeof(ackbuf));
-        ackbuf[offsetof(rudp_packet_t, type)] = ACK;
-        memcpy(ackbuf + offsetof(rudp_packet_t, seqnum), &pkt.seqnum, sizeof(uint32_t));
-        /* find conn for this socket */
-        for (int i = 0; i < MAX_SOCKETS; i++) {
-            if (rudp_conns[i].sockfd == socket) {
-                sendto(socket, ackbuf, sizeof(ackbuf), 0, (struct sockaddr*)&rudp_conns[i].addr, rudp_conns[i].addrlen);
-                break;
+    zc->map = map;
+    zc->map_len = map_len;
+    zc->buf = (const char*)map + (offset - base);
+    return queue_zc(socket, zc->buf, len, zc, 1);
+}
+
+/* copy a delivered payload into the caller's buffer */
+static int deliver(char* buf, int len, const uint8_t* payload, int payload_len) {
+    int to_copy = payload_len > len ? len : payload_len;
+    /* Clear the buffer first to ensure proper null termination */
+    memset(buf, 0, len);
+    if (to_copy > 0)
+        memcpy(buf, payload, to_copy);
+    return to_copy;
+}
+
+/* packets the reorder buffer and delivery queue may each hold: the peer's
+   send window at its memory ceiling; untouched slots cost no memory */
+static unsigned int receive_capacity(const struct rudp_conn* conn) {
+    unsigned int cap = (unsigned int)(window_ceiling(conn) / DATAGRAM_LEN);
+    return cap < RWND_SIZE ? RWND_SIZE : cap;
+}
+
+/* Describe the runs held in the reorder buffer past `from` as SACK blocks. */
+static void build_sack(struct rudp_conn* conn, uint32_t from, rudp_sack_t* sack) {
+    sack->nblocks = 0;
+    if (!conn->reorder) return;
+
+    /* nothing was ever buffered past reorder_end */
+    uint32_t span = conn->reorder_end - conn->recv_seq;
+    if (!SEQ_LT(conn->recv_seq, conn->reorder_end)) return;
+    if (span > conn->reorder_cap) span = conn->reorder_cap;
+
+    int in_run = 0;
+    for (uint32_t off = from - conn->recv_seq; off < span; off++) {
+        uint32_t seq = conn->recv_seq + off;
+        if (conn->reorder[seq & (conn->reorder_cap - 1)].valid) {
+            if (!in_run) {
+                if (sack->nblocks == MAX_SACK) break;
+                sack->blocks[sack->nblocks].start = seq;
+                sack->nblocks++;
+                in_run = 1;
             }
+            sack->blocks[sack->nblocks - 1].end = seq;
         }
-        
-        /* Only process data if this is the expected sequence number */
-        if (pkt.seqnum == recv_seq) {
-            /* Clear the buffer first to ensure proper null termination */
-            memset(buf, 0, len);
-            
-            if (to_copy > 0) {
-                memcpy(buf, pkt.payload, to_copy);
-            }
+        else {
+            in_run = 0;
+        }
+    }
+}
+
+/* Fill in the acknowledgement fields of an outgoing header: the next
+   in-order seqnum expected, and how many more in-order packets the
+   delivery queue can take. Caller holds conn->lock. */
+void ack_header(struct rudp_conn* conn, rudp_packet_t* hdr) {
+    pthread_mutex_lock(&conn->rxq.lock);
+    unsigned int cap = receive_capacity(conn);
+    unsigned int room = cap > conn->rxq.count ? cap - conn->rxq.count : 0;
+    pthread_mutex_unlock(&conn->rxq.lock);
+
+    hdr->ack = htole32(conn->recv_seq);
+    hdr->wnd = htole16(room > UINT16_MAX ? UINT16_MAX : (uint16_t)room);
+}
+
+/* acknowledge everything delivered in order so far (cumulative), plus
+   SACK blocks for anything buffered beyond it. Caller holds conn->lock. */
+void send_ack(struct rudp_conn* conn) {
+    const size_t hdr_size = offsetof(rudp_packet_t, payload);
+    rudp_packet_t ack = {.version = RUDP_VERSION, .type = ACK, .connid = htole16(conn->connid)};
+    rudp_sack_t sack;
+
+    ack_header(conn, &ack);
+    conn->ack_owed = 0;
+    conn->ack_now = 0;
+    conn->ack_pending = 0;
+    conn->acks_sent++;
+
+    /* the SACK blocks ride in the payload */
+    size_t ack_len = hdr_size;
+    build_sack(conn, conn->recv_seq, &sack);
+    if (sack.nblocks > 0) {
+        for (unsigned int b = 0; b < sack.nblocks; b++) {
+            sack.blocks[b].start = htole32(sack.blocks[b].start);
+            sack.blocks[b].end = htole32(sack.blocks[b].end);
+        }
+        size_t sack_len = offsetof(rudp_sack_t, blocks) + sack.nblocks * sizeof(sack.blocks[0]);
+        memcpy(ack.payload, &sack, sack_len);
+        ack_len += sack_len;
+    }
+    if (conn->impair) {
+        impair_send(conn, &ack, ack_len);
+    }
+    else {
+        /* never block the backend; a lost ACK is covered by the next one */
+        sendto(conn->sockfd, &ack, ack_len, MSG_DONTWAIT, (struct sockaddr*)&conn->addr, conn->addrlen);
+        rudp_trace(TRACE_OUT, conn->sockfd, &ack, ack_len, 0);
+    }
+}
 
-            /* bump receive counter to help harness (if present) */
-            recv_seq++;
+/* `n` data packets arrived. The ACK waits until ack_every packets are
+   owed, for at most ack_delay_us, so a bulk flow is acknowledged every few
+   packets and a reply can carry it as PIGGYBACK; the backend sends it
+   alone once it is due. Anything out of order, and every arrival while a
+   hole remains, is acknowledged at once so SACKs and duplicate ACKs reach
+   the sender undelayed. Caller holds conn->lock. */
+void acknowledge(struct rudp_conn* conn, unsigned int n, uint64_t now) {
+    conn->ack_owed += n;
+    if (conn->ack_now || conn->ack_owed >= conn->ack_every || conn->ack_delay_us == 0 ||
+        SEQ_LT(conn->recv_seq, conn->reorder_end)) {
+        send_ack(conn);
+        return;
+    }
+    if (conn->ack_pending) return;
+
+    conn->ack_pending = 1;
+    conn->ack_due_us = now + conn->ack_delay_us;
+    ready_conn(conn); /* so the backend schedules the deadline */
+}
+
+/* keep a future packet until the gap before it fills; duplicates are ignored */
+static void buffer_out_of_order(struct rudp_conn* conn, uint32_t seq, const rudp_packet_t* pkt, int payload_len) {
+    if (!conn->reorder) {
+        /* a power of two, so a seqnum's slot is found by masking */
+        unsigned int cap = RWND_SIZE;
+        while (cap < receive_capacity(conn)) cap *= 2;
+        conn->reorder = calloc(cap, sizeof(rwnd_entry_t));
+        if (!conn->reorder) return;
+        conn->reorder_cap = cap;
+    }
+
+    uint32_t ahead = seq - conn->recv_seq;
+    if (ahead >= conn->reorder_cap) {
+        conn->ooo_dropped++; /* beyond what we can hold: sender will retransmit */
+        return;
+    }
+
+    rwnd_entry_t* slot = &conn->reorder[seq & (conn->reorder_cap - 1)];
+    if (slot->valid) return;
+    memcpy(slot->payload, pkt->payload, payload_len);
+    slot->len = payload_len;
+    slot->valid = 1;
+    if (SEQ_LT(conn->reorder_end, seq + 1)) conn->reorder_end = seq + 1;
+}
+
+/* The kernel dropped datagrams for want of receive buffer: double SO_RCVBUF,
+   up to the connection's memory ceiling. Caller holds conn->lock. */
+void note_drops(struct rudp_conn* conn, struct msghdr* msg) {
+    for (struct cmsghdr* cm = CMSG_FIRSTHDR(msg); cm != NULL; cm = CMSG_NXTHDR(msg, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SO_RXQ_OVFL) continue;
+        uint32_t drops;
+        memcpy(&drops, CMSG_DATA(cm), sizeof(drops));
+        if (drops == conn->rx_drops) return;
+        conn->rx_drops = drops;
 
-            return to_copy;
-        } else {
-            /* Duplicate or out-of-order packet - ACK sent but don't process data again */
-            return 0;
+        size_t cur = conn->rcvbuf;
+        if (cur == 0) {
+            int val = 0;
+            socklen_t vallen = sizeof(val);
+            getsockopt(conn->sockfd, SOL_SOCKET, SO_RCVBUF, &val, &vallen);
+            cur = (size_t)val / 2; /* the kernel reports twice what was set */
         }
+        tune_sockbuf(conn, SO_RCVBUF, 2 * cur);
+        return;
     }
+}
+
+/* Make room for n more payloads in the delivery queue, growing it by
+   doubling. Fails once the reader is a full receive capacity behind.
+   Caller holds q->lock. */
+static int rxq_reserve(struct rudp_conn* conn, unsigned int n) {
+    struct rudp_rxq* q = &conn->rxq;
+    if (q->count + n <= q->cap) return 0;
+
+    unsigned int limit = receive_capacity(conn);
+    if (q->count + n > limit) return -1;
+    unsigned int cap = q->cap ? q->cap : RXQ_MIN;
+    while (cap < q->count + n) cap *= 2;
+    if (cap > limit) cap = limit;
 
+    rwnd_entry_t* slots = malloc(cap * sizeof(*slots));
+    if (!slots) return -1;
+    /* unroll the ring into the new array */
+    for (unsigned int i = 0; i < q->count; i++) {
+        const rwnd_entry_t* from = &q->slots[(q->head + i) % q->cap];
+        slots[i].len = from->len;
+        memcpy(slots[i].payload, from->payload, from->len);
+    }
+    free(q->slots);
+    q->slots = slots;
+    q->head = 0;
+    q->cap = cap;
     return 0;
 }
+
+static void rxq_append(struct rudp_rxq* q, const uint8_t* payload, size_t len) {
+    rwnd_entry_t* slot = &q->slots[(q->head + q->count) % q->cap];
+    memcpy(slot->payload, payload, len);
+    slot->len = len;
+    q->count++;
+}
+
+/* Take one DAT datagram read by the backend: the in-order packet is queued
+   for delivery together with the run buffered right after it, future ones
+   wait in the reorder buffer, duplicates and stale packets only prompt the
+   caller's re-ACK. Caller holds conn->lock. */
+void receive_data(struct rudp_conn* conn, const rudp_packet_t* pkt, size_t len) {
+    const size_t hdr_size = offsetof(rudp_packet_t, payload);
+    if (len > DATAGRAM_LEN) len = DATAGRAM_LEN; /* the slots hold PKT_LEN bytes */
+    int payload_len = (int)(len - hdr_size);
+
+    uint32_t seq = le32toh(pkt->seqnum);
+
+    if (seq != conn->recv_seq) {
+        if (SEQ_LT(conn->recv_seq, seq)) buffer_out_of_order(conn, seq, pkt, payload_len);
+        conn->ack_now = 1;
+        return;
+    }
+
+    unsigned int run = 0;
+    if (conn->reorder) {
+        while (run + 1 < conn->reorder_cap &&
+               conn->reorder[(conn->recv_seq + 1 + run) & (conn->reorder_cap - 1)].valid)
+            run++;
+    }
+
+    /* all or nothing, so the packet at recv_seq is never held back: when
+       the reader is too far behind it is dropped unacknowledged and the
+       sender retransmits it */
+    struct rudp_rxq* q = &conn->rxq;
+    pthread_mutex_lock(&q->lock);
+    if (rxq_reserve(conn, 1 + run) < 0) {
+        pthread_mutex_unlock(&q->lock);
+        conn->rxq_dropped++;
+        conn->ack_now = 1; /* the window we advertised has closed */
+        return;
+    }
+    rxq_append(q, pkt->payload, (size_t)payload_len);
+    conn->recv_seq++;
+    if (run > 0) conn->ack_now = 1; /* a hole filled: let the sender know */
+    for (; run > 0; run--) {
+        rwnd_entry_t* slot = &conn->reorder[conn->recv_seq & (conn->reorder_cap - 1)];
+        rxq_append(q, slot->payload, slot->len);
+        slot->valid = 0;
+        conn->recv_seq++;
+    }
+    pthread_cond_signal(&q->nonempty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* Dequeue from `conn`, which the caller holds a reference to. */
+static int recv_conn(struct rudp_conn* conn, int socket, char* buf, int len) {
+    struct rudp_rxq* q = &conn->rxq;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->count == 0 && !q->closed) {
+        /* only a reader that has to sleep pays for the timeout lookup */
+        pthread_mutex_unlock(&q->lock);
+        struct timeval tv = {0, 0};
+        socklen_t tvlen = sizeof(tv);
+        getsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &tv, &tvlen);
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += tv.tv_sec;
+        deadline.tv_nsec += (long)tv.tv_usec * 1000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        pthread_mutex_lock(&q->lock);
+        while (q->count == 0 && !q->closed) {
+            if (tv.tv_sec == 0 && tv.tv_usec == 0) {
+                pthread_cond_wait(&q->nonempty, &q->lock);
+            }
+            else if (pthread_cond_timedwait(&q->nonempty, &q->lock, &deadline) == ETIMEDOUT) {
+                pthread_mutex_unlock(&q->lock);
+                errno = EAGAIN;
+                return -1;
+            }
+        }
+    }
+    /* what arrived before a disconnect is still delivered */
+    if (q->count == 0) {
+        pthread_mutex_unlock(&q->lock);
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    const rwnd_entry_t* slot = &q->slots[q->head];
+    int result = deliver(buf, len, slot->payload, (int)slot->len);
+    q->head = (q->head + 1) % q->cap;
+    q->count--;
+    pthread_mutex_unlock(&q->lock);
+    return result;
+}
+
+/* receive the next in-order rudp packet from the connection's delivery
+   queue, waiting as long as the socket's SO_RCVTIMEO allows. Returns
+   number of payload bytes copied. */
+int sans_recv_pkt(int socket, char* buf, int len) {
+    struct rudp_conn* conn = rudp_conn_lookup(socket);
+    if (!conn) { errno = ENOTCONN; return -1; }
+    int result = recv_conn(conn, socket, buf, len);
+    rudp_conn_put(conn);
+    return result;
+}
@@ -84,6 +84,19 @@ int smtp_agent(const char* host, int port) {
     size_t nread;
     int last_byte = -1;
 
+    /* Stream the file straight from its pages when the connection can;
+       the copy loop sends whatever a short count left over */
+    struct stat st;
+    long streamed = 0;
+    if (fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode))
+        streamed = sans_send_file(conn, fileno(f), 0, (long)st.st_size);
+    if (streamed > 0) {
+        if (fseek(f, streamed - 1, SEEK_SET) == 0)
+            last_byte = fgetc(f); /* leaves f at `streamed` */
+        else
+            fseek(f, 0, SEEK_END);
+    }
+
     while ((nread = fread(filebuf, 1, sizeof(filebuf), f)) > 0) {
         if (sans_send_pkt(conn, filebuf, nread) < 0) {
             fclose(f);
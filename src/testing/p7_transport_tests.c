@@ -0,0 +1,1317 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "testing.h"
+#include "rudp.h"
+#include "sans.h"
+
+/* Transport behaviour over real loopback connections, driven by the
+   backend thread t__p7_tests() started. The socket mocks are switched
+   off first, so every call reaches the kernel. */
+
+#define NPKTS 500
+#define PAYLOAD 100
+#define HDR_LEN offsetof(rudp_packet_t, payload)
+
+extern const unsigned int swnd_size;
+
+static tests_t tests[] = {
+  {
+    .category = "Reorder Buffer",
+    .prompts = {
+      "Reordered packets delivered in order",
+      "No packet dropped past the reorder buffer",
+    }
+  },
+  {
+    .category = "Send Path",
+    .prompts = {
+      "Bulk flow delivered complete and in order",
+      "Sender blocked on a full window returns",
+      "Blocked sender fails with EPIPE on disconnect",
+    }
+  },
+  {
+    .category = "Listener",
+    .prompts = {
+      "Each peer receives only its own data",
+      "Accepted connection outlives its listener",
+      "Waiting accept returns when the listener closes",
+      "SYNs beyond the backlog are not answered",
+      "A small flow does not shrink the shared socket",
+    }
+  },
+  {
+    .category = "Backend Scheduling",
+    .prompts = {
+      "Lost packets are retransmitted",
+      "Held ACK sent once its delay passes",
+      "Bulk flow completes alongside idle peers",
+    }
+  },
+  {
+    .category = "Receive Path",
+    .prompts = {
+      "Blocked reader fails with ENOTCONN on disconnect",
+    }
+  },
+  {
+    .category = "Selective ACK",
+    .prompts = {
+      "Only packets no block covers are resent",
+      "Window drains once the hole is acknowledged",
+    }
+  },
+  {
+    .category = "Retransmit Timeout",
+    .prompts = {
+      "RTO follows the measured round trip",
+      "RTO doubles on each timeout",
+    }
+  },
+  {
+    .category = "Fast Retransmit",
+    .prompts = {
+      "Third duplicate ACK resends the hole at once",
+      "Fewer duplicate ACKs resend nothing",
+    }
+  },
+  {
+    .category = "Congestion Control",
+    .prompts = {
+      "cwnd grows on ACKs under each algorithm",
+      "Each algorithm cuts cwnd by its own factor on loss",
+      "Unknown algorithm refused",
+    }
+  },
+  {
+    .category = "UDP Offload",
+    .prompts = {
+      "Full-size flows delivered with offload on",
+      "Offload refused on a listener's shared socket",
+    }
+  },
+  {
+    .category = "Window Autotuning",
+    .prompts = {
+      "Window grows past its initial size on a long path",
+      "Window stays within SANS_OPT_WINDOW_MAX",
+    }
+  },
+  {
+    .category = "Impairment",
+    .prompts = {
+      "Duplicated packets delivered once",
+      "Delay adds to the measured round trip",
+      "Rate limit paces the flow",
+    }
+  },
+  {
+    .category = "Statistics",
+    .prompts = {
+      "Counters match a scripted loss exactly",
+      "Counters add up over a lossy flow",
+    }
+  },
+  {
+    .category = "Packet Trace",
+    .prompts = {
+      "Dump is a well-formed pcap file",
+      "Dump holds every packet sent and received",
+    }
+  },
+  {
+    .category = "Zero-Copy Send",
+    .prompts = {
+      "Completion reports the data acknowledged",
+      "Completion reports a send cut short",
+    }
+  },
+  {
+    .category = "File Send",
+    .prompts = {
+      "Whole file arrives byte for byte",
+      "Range from an offset arrives byte for byte",
+    }
+  },
+  {
+    .category = "Wire Header",
+    .prompts = {
+      "Data goes out behind the 14-byte little-endian header",
+      "Datagrams of another version or cut short are dropped",
+    }
+  },
+  {
+    .category = "Piggybacked ACK",
+    .prompts = {
+      "Reply carries the pending ACK",
+      "No separate ACK follows the reply",
+      "Peer's piggybacked ACK releases the window",
+    }
+  },
+};
+
+/* the loopback port a listener was bound to */
+static int listener_port(int listener) {
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  if (getsockname(listener, (struct sockaddr*)&addr, &len) < 0) return -1;
+  return ntohs(addr.sin_port);
+}
+
+/* Connect a client to a listener on an ephemeral loopback port and accept
+   it. Returns 0, or -1 with nothing left open. */
+static int open_pair(int* listener, int* client, int* server) {
+  *listener = sans_listen("127.0.0.1", 0, IPPROTO_RUDP);
+  if (*listener < 0) return -1;
+  if ((*client = sans_connect("127.0.0.1", listener_port(*listener), IPPROTO_RUDP)) < 0) {
+    sans_disconnect(*listener);
+    return -1;
+  }
+  if ((*server = sans_accept_conn(*listener)) < 0) {
+    sans_disconnect(*client);
+    sans_disconnect(*listener);
+    return -1;
+  }
+  return 0;
+}
+
+static void close_pair(int listener, int client, int server) {
+  sans_disconnect(client);
+  sans_disconnect(server);
+  sans_disconnect(listener);
+}
+
+/* Send packets numbered from 0 to n - 1. Returns how many were queued. */
+static int send_numbered(int sock, int n) {
+  char buf[PAYLOAD] = {0};
+  for (int i = 0; i < n; i++) {
+    memcpy(buf, &i, sizeof(i));
+    if (sans_send_pkt(sock, buf, sizeof(buf)) < 0) return i;
+  }
+  return n;
+}
+
+/* Receive n packets. Returns how many arrived before the first one out of
+   order or of the wrong size. */
+static int recv_numbered(int sock, int n) {
+  char buf[PKT_LEN];
+  for (int i = 0; i < n; i++) {
+    if (sans_recv_pkt(sock, buf, sizeof(buf)) != PAYLOAD || memcmp(buf, &i, sizeof(i)) != 0)
+      return i;
+  }
+  return n;
+}
+
+/* -------------------------  Reorder Buffer  -------------------------- */
+static void test_reorder(void) {
+  int l, c, s;
+  if (open_pair(&l, &c, &s) < 0) {
+    assert(0, tests[0].results[0], "FAIL - Could not open a loopback connection");
+    return;
+  }
+
+  /* hold back a quarter of the packets so later ones overtake them */
+  struct sans_impair impair = { .reorder = 0.25, .reorder_us = 2000, .seed = 7 };
+  sans_setopt(c, SANS_OPT_IMPAIR, &impair, sizeof(impair));
+  send_numbered(c, NPKTS);
+  assert(recv_numbered(s, NPKTS) == NPKTS, tests[0].results[0],
+         "FAIL - Packets were lost or delivered out of order");
+
+  struct sans_stats stats;
+  assert(sans_get_stats(s, &stats) == 0 && stats.ooo_dropped == 0, tests[0].results[1],
+         "FAIL - Out-of-order packets were dropped by the receiver");
+  close_pair(l, c, s);
+}
+
+/* ----------------------------  Send Path  ---------------------------- */
+struct flow {
+  int sock;
+  int n;
+  atomic_int done;
+  int result;
+  int err;
+};
+
+static void* flow_receiver(void* arg) {
+  struct flow* f = arg;
+  f->result = recv_numbered(f->sock, f->n);
+  return NULL;
+}
+
+static void* flow_sender(void* arg) {
+  struct flow* f = arg;
+  f->result = send_numbered(f->sock, f->n);
+  f->err = errno;
+  atomic_store(&f->done, 1);
+  return NULL;
+}
+
+/* Whether a flow's thread finished within `ms` milliseconds. */
+static int finished(struct flow* f, int ms) {
+  for (int i = 0; i < ms && !atomic_load(&f->done); i++)
+    usleep(1000);
+  return atomic_load(&f->done);
+}
+
+static void test_bulk(void) {
+  int l, c, s;
+  if (open_pair(&l, &c, &s) < 0) {
+    assert(0, tests[1].results[0], "FAIL - Could not open a loopback connection");
+    return;
+  }
+
+  struct flow f = { .sock = s, .n = 20 * NPKTS };
+  pthread_t reader;
+  pthread_create(&reader, NULL, flow_receiver, &f);
+  int sent = send_numbered(c, f.n);
+  pthread_join(reader, NULL);
+  assert(sent == f.n && f.result == f.n, tests[1].results[0],
+         "FAIL - Packets were lost or delivered out of order");
+  close_pair(l, c, s);
+}
+
+/* the peer never reads, so its queue and then the sender's window fill */
+static void test_blocked_disconnect(void) {
+  int l, c, s;
+  if (open_pair(&l, &c, &s) < 0) {
+    assert(0, tests[1].results[1], "FAIL - Could not open a loopback connection");
+    return;
+  }
+
+  struct flow f = { .sock = c, .n = 1000 * NPKTS };
+  pthread_t sender;
+  pthread_create(&sender, NULL, flow_sender, &f);
+  usleep(200000);
+  assert(!atomic_load(&f.done), tests[1].results[1],
+         "FAIL - Sender never blocked on a peer that does not read");
+
+  sans_disconnect(c);
+  int woke = finished(&f, 1000);
+  if (woke)
+    pthread_join(sender, NULL);
+  else
+    pthread_detach(sender);
+  assert(woke, tests[1].results[1], "FAIL - Blocked sender did not return on disconnect");
+  assert(f.result < f.n && f.err == EPIPE, tests[1].results[2],
+         "FAIL - Blocked send did not fail with EPIPE");
+  sans_disconnect(s);
+  sans_disconnect(l);
+}
+
+/* -----------------------------  Listener  ---------------------------- */
+/* Send `msg` on one socket and check it, and only it, arrives on the other. */
+static int exchange(int from, int to, const char* msg) {
+  char buf[PKT_LEN];
+  int len = (int)strlen(msg);
+  return sans_send_pkt(from, msg, len) == len && sans_recv_pkt(to, buf, sizeof(buf)) == len &&
+         memcmp(buf, msg, len) == 0;
+}
+
+static void test_peers(void) {
+  int l, c1, s1, c2, s2;
+  if (open_pair(&l, &c1, &s1) < 0) {
+    assert(0, tests[2].results[0], "FAIL - Could not open a loopback connection");
+    return;
+  }
+  c2 = sans_connect("127.0.0.1", listener_port(l), IPPROTO_RUDP);
+  s2 = c2 < 0 ? -1 : sans_accept_conn(l);
+  if (s2 < 0) {
+    assert(0, tests[2].results[0], "FAIL - Second peer could not connect");
+    close_pair(l, c1, s1);
+    return;
+  }
+
+  assert(exchange(c2, s2, "second peer") && exchange(c1, s1, "first peer") &&
+         exchange(s1, c1, "to the first") && exchange(s2, c2, "to the second"),
+         tests[2].results[0], "FAIL - Data reached the wrong connection");
+  sans_disconnect(c2);
+  sans_disconnect(s2);
+  close_pair(l, c1, s1);
+}
+
+static void test_outlives_listener(void) {
+  int l, c, s;
+  if (open_pair(&l, &c, &s) < 0) {
+    assert(0, tests[2].results[1], "FAIL - Could not open a loopback connection");
+    return;
+  }
+
+  sans_disconnect(l);
+  assert(exchange(c, s, "after close") && exchange(s, c, "reply"), tests[2].results[1],
+         "FAIL - Connection stopped working when its listener closed");
+  sans_disconnect(c);
+  sans_disconnect(s);
+}
+
+static void* accept_waiter(void* arg) {
+  return (void*)(long)sans_accept_conn(*(int*)arg);
+}
+
+static void test_accept_close(void) {
+  int l = sans_listen("127.0.0.1", 0, IPPROTO_RUDP);
+  if (l < 0) {
+    assert(0, tests[2].results[2], "FAIL - Could not open a listener");
+    return;
+  }
+
+  pthread_t waiter;
+  void* result;
+  pthread_create(&waiter, NULL, accept_waiter, &l);
+  usleep(100000);
+  sans_disconnect(l);
+  pthread_join(waiter, &result);
+  assert((long)result == -1, tests[2].results[2], "FAIL - Accept did not fail once the listener closed");
+}
+
+/* one SYN from each of BACKLOG_MAX + 10 sockets no one accepts */
+static void test_backlog_cap(void) {
+  enum { NSYNS = BACKLOG_MAX + 10 };
+  int l = sans_listen("127.0.0.1", 0, IPPROTO_RUDP);
+  if (l < 0) {
+    assert(0, tests[2].results[3], "FAIL - Could not open a listener");
+    return;
+  }
+
+  struct sockaddr_in addr = {
+    .sin_family = AF_INET,
+    .sin_port = htons(listener_port(l)),
+    .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+  };
+  rudp_packet_t syn = { .version = RUDP_VERSION, .type = SYN };
+  const size_t hdr_len = offsetof(rudp_packet_t, payload);
+  int peers[NSYNS];
+  for (int i = 0; i < NSYNS; i++) {
+    peers[i] = socket(AF_INET, SOCK_DGRAM, 0);
+    sendto(peers[i], &syn, hdr_len, 0, (struct sockaddr*)&addr, sizeof(addr));
+  }
+  usleep(100000);
+
+  int answered = 0;
+  for (int i = 0; i < NSYNS; i++) {
+    rudp_packet_t synack;
+    ssize_t n = recv(peers[i], &synack, sizeof(synack), MSG_DONTWAIT);
+    if (n >= (ssize_t)hdr_len && synack.type == (SYN | ACK)) answered++;
+    close(peers[i]);
+  }
+  assert(answered == BACKLOG_MAX, tests[2].results[3],
+         "FAIL - Listener answered more or fewer SYNs than its backlog holds");
+  sans_disconnect(l);
+}
+
+static int sndbuf(int sock) {
+  int val = 0;
+  socklen_t len = sizeof(val);
+  getsockopt(sock, SOL_SOCKET, SO_SNDBUF, &val, &len);
+  return val;
+}
+
+/* both accepted connections send through the listener's socket */
+static void test_shared_sockbuf(void) {
+  int l, c1, s1, c2, s2;
+  if (open_pair(&l, &c1, &s1) < 0) {
+    assert(0, tests[2].results[4], "FAIL - Could not open a loopback connection");
+    return;
+  }
+  c2 = sans_connect("127.0.0.1", listener_port(l), IPPROTO_RUDP);
+  s2 = c2 < 0 ? -1 : sans_accept_conn(l);
+  if (s2 < 0) {
+    assert(0, tests[2].results[4], "FAIL - Second peer could not connect");
+    close_pair(l, c1, s1);
+    return;
+  }
+
+  struct flow bulk = { .sock = c1, .n = 20 * NPKTS };
+  pthread_t reader;
+  pthread_create(&reader, NULL, flow_receiver, &bulk);
+  send_numbered(s1, bulk.n);
+  pthread_join(reader, NULL);
+  int grown = sndbuf(l);
+
+  struct flow small = { .sock = c2, .n = NPKTS };
+  pthread_create(&reader, NULL, flow_receiver, &small);
+  send_numbered(s2, small.n);
+  pthread_join(reader, NULL);
+  assert(bulk.result == bulk.n && small.result == small.n && sndbuf(l) >= grown,
+         tests[2].results[4], "FAIL - A small flow shrank the socket its listener shares");
+
+  sans_disconnect(c2);
+  sans_disconnect(s2);
+  close_pair(l, c1, s1);
+}
+
+/* ------------------------  Backend Scheduling  ----------------------- */
+/* nothing but the retransmit deadlines recovers the dropped packets */
+static void test_retransmit(void) {
+  int l, c, s;
+  if (open_pair(&l, &c, &s) < 0) {
+    assert(0, tests[3].results[0], "FAIL - Could not open a loopback connection");
+    return;
+  }
+
+  struct sans_impair impair = { .loss = 0.1, .seed = 3 };
+  sans_setopt(c, SANS_OPT_IMPAIR, &impair, sizeof(impair));
+  send_numbered(c, NPKTS);
+  int received = recv_numbered(s, NPKTS);
+
+  struct sans_stats stats;
+  assert(received == NPKTS && sans_get_stats(c, &stats) == 0 && stats.retransmits > 0,
+         tests[3].results[0], "FAIL - Dropped packets were not resent");
+  close_pair(l, c, s);
+}
+
+/* too few packets to fill `every`: only the ACK's deadline releases it */
+static void test_held_ack(void) {
+  int l, c, s;
+  if (open_pair(&l, &c, &s) < 0) {
+    assert(0, tests[3].results[1], "FAIL - Could not open a loopback connection");
+    return;
+  }
+
+  struct sans_ack policy = { .every = 64, .delay_us = ACK_DELAY_MAX_US };
+  sans_setopt(s, SANS_OPT_ACK, &policy, sizeof(policy));
+  send_numbered(c, 1);
+  recv_numbered(s, 1);
+  usleep(50000);
+
+  struct sans_stats sent, received;
+  assert(sans_get_stats(c, &sent) == 0 && sent.queued == 0 &&
+         sans_get_stats(s, &received) == 0 && received.acks_sent > 0,
+         tests[3].results[1], "FAIL - Held ACK never went out");
+  close_pair(l, c, s);
+}
+
+static void test_idle_peers(void) {
+  enum { NIDLE = 100 };
+  int l, c, s;
+  int idle[NIDLE][2];
+  if (open_pair(&l, &c, &s) < 0) {
+    assert(0, tests[3].results[2], "FAIL - Could not open a loopback connection");
+    return;
+  }
+
+  /* each idle peer has sent once, so the backend has seen it busy */
+  int nidle = 0;
+  for (; nidle < NIDLE; nidle++) {
+    int port = listener_port(l);
+    idle[nidle][0] = sans_connect("127.0.0.1", port, IPPROTO_RUDP);
+    idle[nidle][1] = idle[nidle][0] < 0 ? -1 : sans_accept_conn(l);
+    if (idle[nidle][1] < 0 || !exchange(idle[nidle][0], idle[nidle][1], "idle")) break;
+  }
+
+  struct flow f = { .sock = s, .n = 10 * NPKTS };
+  pthread_t reader;
+  pthread_create(&reader, NULL, flow_receiver, &f);
+  int sent = send_numbered(c, f.n);
+  pthread_join(reader, NULL);
+  assert(nidle == NIDLE && sent == f.n && f.result == f.n, tests[3].results[2],
+         "FAIL - Flow did not complete with idle peers connected");
+
+  for (int i = 0; i < nidle; i++) {
+    sans_disconnect(idle[i][0]);
+    sans_disconnect(idle[i][1]);
+  }
+  close_pair(l, c, s);
+}
+
+/* ---------------------------  Receive Path  -------------------------- */
+static void* blocked_receiver(void* arg) {
+  struct flow* f = arg;
+  char buf[PKT_LEN];
+  f->result = sans_recv_pkt(f->sock, buf, sizeof(buf));
+  f->err = errno;
+  atomic_store(&f->done, 1);
+  return NULL;
+}
+
+/* nothing is sent, so only the disconnect can end the read */
+static void test_blocked_reader(void) {
+  int l, c, s;
+  if (open_pair(&l, &c, &s) < 0) {
+    assert(0, tests[4].results[0], "FAIL - Could not open a loopback connection");
+    return;
+  }
+
+  struct flow f = { .sock = s };
+  pthread_t reader;
+  pthread_create(&reader, NULL, blocked_receiver, &f);
+  usleep(100000);
+  int blocked = !atomic_load(&f.done);
+  sans_disconnect(s);
+  int woke = finished(&f, 1000);
+  if (woke)
+    pthread_join(reader, NULL);
+  else
+    pthread_detach(reader);
+  assert(blocked && woke && f.result < 0 && f.err == ENOTCONN, tests[4].results[0],
+         "FAIL - Blocked reader did not fail with ENOTCONN on disconnect");
+  sans_disconnect(c);
+  sans_disconnect(l);
+}
+
+/* -----------------------------  Raw Peer  --------------------------- */
+/* A plain UDP socket speaking the wire format by hand, so a test decides
+   which packets are acknowledged, and when. */
+struct raw_peer {
+  int fd;
+  struct sockaddr_storage addr; /* the RUDP socket's */
+  socklen_t addrlen;
+};
+
+/* Read the next datagram within `ms` milliseconds. Returns its length, or -1. */
+static int raw_recv(struct raw_peer* p, rudp_packet_t* pkt, int ms) {
+  struct pollfd pfd = { .fd = p->fd, .events = POLLIN };
+  if (poll(&pfd, 1, ms) <= 0) return -1;
+  p->addrlen = sizeof(p->addr);
+  return (int)recvfrom(p->fd, pkt, sizeof(*pkt), MSG_DONTWAIT, (struct sockaddr*)&p->addr,
+                       &p->addrlen);
+}
+
+/* answer the SYN sans_connect() sends, then take its ACK */
+static void* raw_answer(void* arg) {
+  struct raw_peer* p = arg;
+  rudp_packet_t pkt;
+  if (raw_recv(p, &pkt, 1000) < (int)HDR_LEN || pkt.type != SYN) return NULL;
+  rudp_packet_t synack = { .version = RUDP_VERSION, .type = SYN | ACK };
+  sendto(p->fd, &synack, HDR_LEN, 0, (struct sockaddr*)&p->addr, p->addrlen);
+  raw_recv(p, &pkt, 1000);
+  return NULL;
+}
+
+/* Connect an RUDP socket to a raw peer. Returns 0, or -1 with nothing left open. */
+static int open_raw(int* sock, struct raw_peer* p) {
+  struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+  socklen_t len = sizeof(addr);
+  p->fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (p->fd < 0) return -1;
+  if (bind(p->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      getsockname(p->fd, (struct sockaddr*)&addr, &len) < 0) {
+    close(p->fd);
+    return -1;
+  }
+
+  pthread_t answer;
+  pthread_create(&answer, NULL, raw_answer, p);
+  *sock = sans_connect("127.0.0.1", ntohs(addr.sin_port), IPPROTO_RUDP);
+  pthread_join(answer, NULL);
+  if (*sock < 0) {
+    close(p->fd);
+    return -1;
+  }
+  return 0;
+}
+
+/* Acknowledge every packet before `next`, with SACK blocks if given (in
+   wire byte order). */
+static void raw_ack(struct raw_peer* p, uint32_t next, const rudp_sack_t* sack) {
+  rudp_packet_t ack = {
+    .version = RUDP_VERSION,
+    .type = ACK,
+    .ack = htole32(next),
+    .wnd = htole16(UINT16_MAX),
+  };
+  size_t len = HDR_LEN;
+  if (sack) {
+    size_t sack_len = offsetof(rudp_sack_t, blocks) + sack->nblocks * sizeof(sack->blocks[0]);
+    memcpy(ack.payload, sack, sack_len);
+    len += sack_len;
+  }
+  sendto(p->fd, &ack, len, 0, (struct sockaddr*)&p->addr, p->addrlen);
+}
+
+/* Acknowledge everything the socket sent, so disconnecting does not wait. */
+static void close_raw(int sock, struct raw_peer* p, uint32_t sent) {
+  raw_ack(p, sent, NULL);
+  sans_disconnect(sock);
+  close(p->fd);
+}
+
+/* ---------------------------  Selective ACK  ------------------------- */
+/* packets 1 and 3 of 6 are lost; the peer has the rest */
+static void test_sack(void) {
+  int sock;
+  struct raw_peer p;
+  if (open_raw(&sock, &p) < 0) {
+    assert(0, tests[5].results[0], "FAIL - Could not connect to a raw peer");
+    return;
+  }
+
+  send_numbered(sock, 6);
+  rudp_packet_t pkt;
+  int seen = 0;
+  while (seen < 6 && raw_recv(&p, &pkt, 1000) > 0) seen++;
+  rudp_sack_t sack = { .nblocks = 2, .blocks = { { htole32(2), htole32(2) }, { htole32(4), htole32(5) } } };
+  raw_ack(&p, 1, &sack);
+
+  /* after a timeout the window is a packet or two, so anything the peer
+     SACKed would be resent in place of the second hole */
+  int resent = 0, others = 0;
+  for (int ms = 1000; raw_recv(&p, &pkt, ms) > 0; ms = 50) {
+    uint32_t seq = le32toh(pkt.seqnum);
+    if (seq == 1 || seq == 3) resent |= 1 << seq;
+    else others++;
+    if (seq == 1) {
+      sack.nblocks = 1;
+      sack.blocks[0] = sack.blocks[1];
+      raw_ack(&p, 3, &sack);
+    }
+    if (seq == 3) raw_ack(&p, 6, NULL);
+  }
+  assert(seen == 6 && resent == ((1 << 1) | (1 << 3)) && others == 0, tests[5].results[0],
+         "FAIL - SACKed packets were resent, or the lost ones were not");
+
+  struct sans_stats stats;
+  assert(sans_get_stats(sock, &stats) == 0 && stats.queued == 0 && stats.in_flight == 0,
+         tests[5].results[1], "FAIL - Acknowledged packets stayed in the window");
+  close_raw(sock, &p, 6);
+}
+
+/* ------------------------  Retransmit Timeout  ----------------------- */
+static uint64_t mono_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/* the peer answers 10 ms late once, then goes silent */
+static void test_rto(void) {
+  int sock;
+  struct raw_peer p;
+  if (open_raw(&sock, &p) < 0) {
+    assert(0, tests[6].results[0], "FAIL - Could not connect to a raw peer");
+    return;
+  }
+
+  rudp_packet_t pkt;
+  struct sans_stats stats = {0};
+  send_numbered(sock, 1);
+  raw_recv(&p, &pkt, 1000);
+  usleep(10000);
+  raw_ack(&p, 1, NULL);
+  for (int i = 0; i < 100 && stats.srtt_us == 0; i++) {
+    usleep(1000);
+    sans_get_stats(sock, &stats);
+  }
+  unsigned int rto = stats.rto_us;
+  assert(stats.srtt_us >= 10000 && stats.srtt_us < 50000 &&
+         rto == stats.srtt_us + 4 * stats.rttvar_us + ACK_DELAY_MAX_US, tests[6].results[0],
+         "FAIL - RTO does not follow a 10 ms round trip");
+
+  /* time three transmissions of a packet that is never acknowledged */
+  uint64_t sent[3] = {0};
+  send_numbered(sock, 1);
+  for (int i = 0; i < 3 && raw_recv(&p, &pkt, 1000) > 0; i++)
+    sent[i] = mono_us();
+  uint64_t first = sent[1] - sent[0], second = sent[2] - sent[1];
+  assert(sent[2] && first >= rto * 3 / 4 && second >= first * 3 / 2, tests[6].results[1],
+         "FAIL - Resends did not back off");
+  close_raw(sock, &p, 2);
+}
+
+/* -------------------------  Fast Retransmit  ------------------------- */
+/* packet 1 of 6 is lost; a 30 ms first round trip puts the RTO well past
+   the duplicate ACKs */
+static void test_fast_retransmit(void) {
+  int sock;
+  struct raw_peer p;
+  if (open_raw(&sock, &p) < 0) {
+    assert(0, tests[7].results[0], "FAIL - Could not connect to a raw peer");
+    return;
+  }
+
+  rudp_packet_t pkt;
+  send_numbered(sock, 6);
+  for (int i = 0; i < 6; i++) raw_recv(&p, &pkt, 1000);
+  usleep(30000);
+  raw_ack(&p, 1, NULL);
+
+  raw_ack(&p, 1, NULL);
+  raw_ack(&p, 1, NULL);
+  assert(raw_recv(&p, &pkt, 10) < 0, tests[7].results[1],
+         "FAIL - Two duplicate ACKs triggered a resend");
+
+  raw_ack(&p, 1, NULL);
+  int resent = raw_recv(&p, &pkt, 20) > 0 && le32toh(pkt.seqnum) == 1;
+  struct sans_stats stats;
+  assert(resent && sans_get_stats(sock, &stats) == 0 && stats.dupacks == 3 && stats.retransmits == 1,
+         tests[7].results[0], "FAIL - Lost packet not resent on the third duplicate ACK");
+  close_raw(sock, &p, 6);
+}
+
+/* ------------------------  Congestion Control  ----------------------- */
+/* Read datagrams until `n` distinct seqnums from `from` on have arrived or
+   the peer has been quiet for `ms`. Returns how many did. */
+static int raw_flight(struct raw_peer* p, uint32_t from, int n, int ms) {
+  uint64_t seen = 0;
+  int distinct = 0;
+  rudp_packet_t pkt;
+  while (distinct < n && raw_recv(p, &pkt, ms) > 0) {
+    uint32_t off = le32toh(pkt.seqnum) - from;
+    if (off < 64 && !(seen & (1ULL << off))) {
+      seen |= 1ULL << off;
+      distinct++;
+    }
+  }
+  return distinct;
+}
+
+/* Slow start from the initial window, then a fast-retransmit loss. A 30 ms
+   first round trip keeps the RTO out of the way. */
+static void test_cc(void) {
+  static const struct { const char* name; unsigned int num, den; } algs[] = {
+    { "reno", 1, 2 },
+    { "cubic", 7, 10 },
+    { "vegas", 1, 2 },
+  };
+  int grew = 0, cut = 0, refused = 0;
+
+  for (size_t a = 0; a < sizeof(algs) / sizeof(algs[0]); a++) {
+    int sock;
+    struct raw_peer p;
+    if (open_raw(&sock, &p) < 0) break;
+    if (sans_setopt(sock, SANS_OPT_CC, algs[a].name, (int)strlen(algs[a].name)) < 0) {
+      close_raw(sock, &p, 0);
+      break;
+    }
+    if (a == 0)
+      refused = sans_setopt(sock, SANS_OPT_CC, "bogus", 5) < 0 && errno == ENOENT;
+
+    /* as much as the initial send window holds */
+    send_numbered(sock, 20);
+    int first = raw_flight(&p, 0, 20, 20);
+    usleep(30000);
+    struct sans_stats before, after;
+    raw_ack(&p, first, NULL);
+    raw_flight(&p, first, 20 - first, 100);
+    grew += sans_get_stats(sock, &after) == 0 && after.cwnd > (unsigned int)first;
+
+    /* one new ACK, then three duplicates of it */
+    raw_ack(&p, first + 1, NULL);
+    usleep(5000);
+    sans_get_stats(sock, &before);
+    for (int i = 0; i < 3; i++) raw_ack(&p, first + 1, NULL);
+    usleep(5000);
+    sans_get_stats(sock, &after);
+    unsigned int expected = before.cwnd * algs[a].num / algs[a].den;
+    cut += after.cwnd + 1 >= expected && after.cwnd <= expected;
+    close_raw(sock, &p, 20);
+  }
+
+  assert(grew == 3, tests[8].results[0], "FAIL - cwnd did not grow past the initial window");
+  assert(cut == 3, tests[8].results[1], "FAIL - Loss did not cut cwnd by the algorithm's factor");
+  assert(refused, tests[8].results[2], "FAIL - Unknown algorithm was accepted");
+}
+
+/* ---------------------------  UDP Offload  --------------------------- */
+/* Only full-size packets are batched into one GSO send, so these flows
+   number PKT_LEN payloads. */
+static int send_full(int sock, int n) {
+  char buf[PKT_LEN] = {0};
+  for (int i = 0; i < n; i++) {
+    memcpy(buf, &i, sizeof(i));
+    if (sans_send_pkt(sock, buf, sizeof(buf)) < 0) return i;
+  }
+  return n;
+}
+
+static void* full_receiver(void* arg) {
+  struct flow* f = arg;
+  char buf[PKT_LEN];
+  int i = 0;
+  while (i < f->n && sans_recv_pkt(f->sock, buf, sizeof(buf)) == PKT_LEN && memcmp(buf, &i, sizeof(i)) == 0)
+    i++;
+  f->result = i;
+  return NULL;
+}
+
+/* the client's own socket sends with GSO and receives with GRO; a kernel
+   without them refuses the option and the flows run without */
+static void test_offload(void) {
+  int l, c, s;
+  if (open_pair(&l, &c, &s) < 0) {
+    assert(0, tests[9].results[0], "FAIL - Could not open a loopback connection");
+    return;
+  }
+
+  int on = 1;
+  sans_setopt(c, SANS_OPT_UDP_OFFLOAD, &on, sizeof(on));
+  assert(sans_setopt(s, SANS_OPT_UDP_OFFLOAD, &on, sizeof(on)) < 0 && errno == EOPNOTSUPP,
+         tests[9].results[1], "FAIL - Offload was turned on for a listener's connection");
+
+  struct flow out = { .sock = s, .n = 4 * NPKTS }, in = { .sock = c, .n = 4 * NPKTS };
+  pthread_t reader;
+  pthread_create(&reader, NULL, full_receiver, &out);
+  int sent = send_full(c, out.n);
+  pthread_join(reader, NULL);
+  pthread_create(&reader, NULL, full_receiver, &in);
+  sent += send_full(s, in.n);
+  pthread_join(reader, NULL);
+  assert(sent == out.n + in.n && out.result == out.n && in.result == in.n, tests[9].results[0],
+         "FAIL - Packets were lost or delivered out of order with offload on");
+  close_pair(l, c, s);
+}
+
+/* ------------------------  Window Autotuning  ------------------------ */
+/* a 10 ms path: the initial window holds far less than a round trip's worth */
+static void test_autotune(void) {
+  enum { WINDOW_MAX = 40 };
+  int l, c, s;
+  if (open_pair(&l, &c, &s) < 0) {
+    assert(0, tests[10].results[0], "FAIL - Could not open a loopback connection");
+    return;
+  }
+
+  int max_bytes = WINDOW_MAX * (int)DATAGRAM_LEN;
+  struct sans_impair impair = { .delay_us = 10000 };
+  sans_setopt(c, SANS_OPT_WINDOW_MAX, &max_bytes, sizeof(max_bytes));
+  sans_setopt(c, SANS_OPT_IMPAIR, &impair, sizeof(impair));
+
+  struct flow f = { .sock = s, .n = NPKTS };
+  pthread_t reader;
+  pthread_create(&reader, NULL, flow_receiver, &f);
+  send_numbered(c, f.n);
+  pthread_join(reader, NULL);
+
+  struct sans_stats stats;
+  int ok = f.result == f.n && sans_get_stats(c, &stats) == 0;
+  assert(ok && stats.window > swnd_size, tests[10].results[0],
+         "FAIL - Window never grew past its initial size");
+  assert(ok && stats.window <= WINDOW_MAX, tests[10].results[1],
+         "FAIL - Window grew past its memory ceiling");
+  close_pair(l, c, s);
+}
+
+/* ----------------------------  Impairment  --------------------------- */
+static void test_duplicate(void) {
+  int l, c, s;
+  if (open_pair(&l, &c, &s) < 0) {
+    assert(0, tests[11].results[0], "FAIL - Could not open a loopback connection");
+    return;
+  }
+
+  struct sans_impair impair = { .duplicate = 0.3, .seed = 5 };
+  sans_setopt(c, SANS_OPT_IMPAIR, &impair, sizeof(impair));
+  send_numbered(c, NPKTS);
+  int received = recv_numbered(s, NPKTS);
+
+  /* nothing beyond the flow itself is delivered */
+  char buf[PKT_LEN];
+  struct timeval tv = { 0, 50000 };
+  setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  assert(received == NPKTS && sans_recv_pkt(s, buf, sizeof(buf)) < 0 && errno == EAGAIN,
+         tests[11].results[0], "FAIL - A duplicated packet was delivered twice, or one was lost");
+  close_pair(l, c, s);
+}
+
+/* 100 full packets through a 20 ms, 8 Mbit/s path take at least 140 ms */
+static void test_shaping(void) {
+  int l, c, s;
+  if (open_pair(&l, &c, &s) < 0) {
+    assert(0, tests[11].results[1], "FAIL - Could not open a loopback connection");
+    return;
+  }
+
+  struct sans_impair impair = { .delay_us = 20000, .rate_kbps = 8000 };
+  sans_setopt(c, SANS_OPT_IMPAIR, &impair, sizeof(impair));
+  struct flow f = { .sock = s, .n = 100 };
+  pthread_t reader;
+  uint64_t start = mono_us();
+  pthread_create(&reader, NULL, full_receiver, &f);
+  send_full(c, f.n);
+  pthread_join(reader, NULL);
+  uint64_t elapsed = mono_us() - start;
+
+  struct sans_stats stats;
+  assert(f.result == f.n && sans_get_stats(c, &stats) == 0 && stats.srtt_us >= 20000,
+         tests[11].results[1], "FAIL - Round trip does not include the 20 ms delay");
+  assert(f.result == f.n && elapsed >= 140000, tests[11].results[2],
+         "FAIL - Flow went faster than the rate limit");
+  close_pair(l, c, s);
+}
+
+/* ----------------------------  Statistics  --------------------------- */
+/* Poll a socket's counters until nothing is left in its window. */
+static int drained_stats(int sock, struct sans_stats* stats) {
+  for (int i = 0; i < 1000; i++) {
+    if (sans_get_stats(sock, stats) < 0) return -1;
+    if (stats->queued == 0) return 0;
+    usleep(1000);
+  }
+  return -1;
+}
+
+/* packet 2 of 5 is lost and recovered by one fast retransmit */
+static void test_stats_scripted(void) {
+  int sock;
+  struct raw_peer p;
+  if (open_raw(&sock, &p) < 0) {
+    assert(0, tests[12].results[0], "FAIL - Could not connect to a raw peer");
+    return;
+  }
+
+  rudp_packet_t pkt;
+  send_numbered(sock, 5);
+  for (int i = 0; i < 5; i++) raw_recv(&p, &pkt, 1000);
+  usleep(10000);
+  for (int i = 0; i < 4; i++) raw_ack(&p, 2, NULL);
+  raw_recv(&p, &pkt, 1000);
+  raw_ack(&p, 5, NULL);
+
+  struct sans_stats stats;
+  assert(drained_stats(sock, &stats) == 0 && stats.packets_sent == 6 &&
+         stats.bytes_sent == 6 * PAYLOAD && stats.retransmits == 1 && stats.dupacks == 3 &&
+         stats.in_flight == 0 && stats.acks_sent == 0 && stats.blocked_us == 0 &&
+         stats.srtt_us > 0 && stats.rto_us > stats.srtt_us,
+         tests[12].results[0], "FAIL - Counters do not match the packets exchanged");
+  close_raw(sock, &p, 5);
+}
+
+static void test_stats_lossy(void) {
+  int l, c, s;
+  if (open_pair(&l, &c, &s) < 0) {
+    assert(0, tests[12].results[1], "FAIL - Could not open a loopback connection");
+    return;
+  }
+
+  struct sans_impair impair = { .loss = 0.1, .seed = 11 };
+  sans_setopt(c, SANS_OPT_IMPAIR, &impair, sizeof(impair));
+  send_numbered(c, NPKTS);
+  int received = recv_numbered(s, NPKTS);
+
+  struct sans_stats sent, got;
+  assert(received == NPKTS && drained_stats(c, &sent) == 0 && sans_get_stats(s, &got) == 0 &&
+         sent.retransmits > 0 && sent.packets_sent == NPKTS + sent.retransmits &&
+         sent.bytes_sent == sent.packets_sent * PAYLOAD && sent.in_flight == 0 &&
+         got.acks_sent > 0 && got.ooo_dropped == 0 && got.rxq_dropped == 0,
+         tests[12].results[1], "FAIL - Counters do not add up over the flow");
+  close_pair(l, c, s);
+}
+
+/* ---------------------------  Packet Trace  -------------------------- */
+/* the dump's layout, as a pcap reader sees it */
+struct pcap_file {
+  uint32_t magic;
+  uint16_t major, minor;
+  int32_t thiszone;
+  uint32_t sigfigs, snaplen, linktype;
+};
+
+struct pcap_record {
+  uint32_t sec, usec, incl_len, orig_len;
+  uint8_t dir;
+  uint8_t type;
+  uint16_t connid;
+  uint32_t seqnum;
+  uint32_t len;
+  int32_t sockfd;
+};
+
+static void test_trace(void) {
+  int l, c, s;
+  if (open_pair(&l, &c, &s) < 0) {
+    assert(0, tests[13].results[0], "FAIL - Could not open a loopback connection");
+    return;
+  }
+  send_numbered(c, NPKTS);
+  recv_numbered(s, NPKTS);
+  struct sans_stats stats;
+  drained_stats(c, &stats);
+
+  char path[] = "/tmp/p7_traceXXXXXX";
+  int fd = mkstemp(path);
+  if (fd >= 0) close(fd);
+  FILE* f = fd >= 0 && sans_trace_dump(path) == 0 ? fopen(path, "rb") : NULL;
+  struct pcap_file hdr;
+  int valid = f && fread(&hdr, sizeof(hdr), 1, f) == 1 && hdr.magic == 0xa1b2c3d4 &&
+              hdr.major == 2 && hdr.minor == 4 && hdr.linktype == 147 &&
+              hdr.snaplen == sizeof(struct pcap_record) - 16;
+
+  /* every record is complete and in time order; mark the flow's DATs */
+  static unsigned char sent[NPKTS], received[NPKTS];
+  memset(sent, 0, sizeof(sent));
+  memset(received, 0, sizeof(received));
+  struct pcap_record rec;
+  uint64_t last = 0;
+  size_t n;
+  while (valid && (n = fread(&rec, 1, sizeof(rec), f)) > 0) {
+    uint64_t ts = (uint64_t)rec.sec * 1000000 + rec.usec;
+    valid = n == sizeof(rec) && rec.incl_len == hdr.snaplen && rec.orig_len == hdr.snaplen &&
+            rec.usec < 1000000 && ts >= last;
+    last = ts;
+    if ((rec.type & ~PIGGYBACK) != DAT || rec.seqnum >= NPKTS) continue;
+    if (rec.dir == TRACE_OUT && rec.sockfd == c) sent[rec.seqnum] = 1;
+    if (rec.dir == TRACE_IN && rec.sockfd == s) received[rec.seqnum] = 1;
+  }
+  if (f) fclose(f);
+  unlink(path);
+  assert(valid, tests[13].results[0], "FAIL - Dump is not a readable pcap file");
+
+  int complete = 1;
+  for (int i = 0; i < NPKTS; i++) complete &= sent[i] && received[i];
+  assert(valid && complete, tests[13].results[1], "FAIL - Packets of the flow are missing from the dump");
+  close_pair(l, c, s);
+}
+
+/* --------------------------  Zero-Copy Send  ------------------------- */
+struct completion {
+  atomic_int calls;
+  atomic_int status;
+  const char* buf;
+};
+
+static void zc_done(const char* buf, void* ctx, int status) {
+  struct completion* done = ctx;
+  done->buf = buf;
+  atomic_store(&done->status, status);
+  atomic_fetch_add(&done->calls, 1);
+}
+
+/* Whether a completion ran within `ms` milliseconds. */
+static int completed(struct completion* done, int ms) {
+  for (int i = 0; i < ms && !atomic_load(&done->calls); i++)
+    usleep(1000);
+  return atomic_load(&done->calls);
+}
+
+/* Receive `len` bytes sliced into packets as a send of `data` would be.
+   Returns whether they all arrived intact. */
+static int recv_bytes(int sock, const char* data, int len) {
+  char buf[PKT_LEN];
+  for (int off = 0; off < len; off += PKT_LEN) {
+    int n = len - off < PKT_LEN ? len - off : PKT_LEN;
+    if (sans_recv_pkt(sock, buf, sizeof(buf)) != n || memcmp(buf, data + off, n) != 0) return 0;
+  }
+  return 1;
+}
+
+static void test_zc_acked(void) {
+  enum { LEN = 3 * PKT_LEN + 100 };
+  int l, c, s;
+  if (open_pair(&l, &c, &s) < 0) {
+    assert(0, tests[14].results[0], "FAIL - Could not open a loopback connection");
+    return;
+  }
+
+  static char data[LEN];
+  for (int i = 0; i < LEN; i++) data[i] = (char)(i * 7);
+  struct completion done = {0};
+  int queued = sans_send_zc(c, data, LEN, zc_done, &done);
+  int intact = recv_bytes(s, data, LEN);
+
+  /* the last ACK may still be on its way */
+  int fired = completed(&done, 1000);
+  usleep(20000);
+  assert(queued == LEN && intact && fired && atomic_load(&done.calls) == 1 &&
+         atomic_load(&done.status) == 0 && done.buf == data,
+         tests[14].results[0], "FAIL - Completion did not run once with status 0 after the data arrived");
+  close_pair(l, c, s);
+}
+
+/* the peer acknowledges nothing, so disconnecting tears the window down */
+static void test_zc_cut(void) {
+  int sock;
+  struct raw_peer p;
+  if (open_raw(&sock, &p) < 0) {
+    assert(0, tests[14].results[1], "FAIL - Could not connect to a raw peer");
+    return;
+  }
+
+  static char data[2 * PKT_LEN];
+  struct completion done = {0};
+  int queued = sans_send_zc(sock, data, sizeof(data), zc_done, &done);
+  rudp_packet_t pkt;
+  raw_recv(&p, &pkt, 1000);
+  int early = atomic_load(&done.calls);
+  sans_disconnect(sock);
+  close(p.fd);
+  assert(queued == (int)sizeof(data) && !early && atomic_load(&done.calls) == 1 &&
+         atomic_load(&done.status) == -1,
+         tests[14].results[1], "FAIL - Completion did not run once with status -1 on disconnect");
+}
+
+/* -----------------------------  File Send  --------------------------- */
+static void test_send_file(void) {
+  enum { LEN = 3 * PKT_LEN + 123, OFFSET = PKT_LEN + 7, RANGE = 500 };
+  int l, c, s;
+  if (open_pair(&l, &c, &s) < 0) {
+    assert(0, tests[15].results[0], "FAIL - Could not open a loopback connection");
+    return;
+  }
+
+  static char data[LEN];
+  for (int i = 0; i < LEN; i++) data[i] = (char)(i * 13 + 1);
+  char path[] = "/tmp/p7_fileXXXXXX";
+  int fd = mkstemp(path);
+  int written = fd >= 0 && write(fd, data, LEN) == LEN;
+  if (fd >= 0) unlink(path);
+
+  long sent = written ? sans_send_file(c, fd, 0, LEN) : -1;
+  assert(sent == LEN && recv_bytes(s, data, LEN), tests[15].results[0],
+         "FAIL - File data was lost, reordered or cut into the wrong packets");
+  sent = written ? sans_send_file(c, fd, OFFSET, RANGE) : -1;
+  assert(sent == RANGE && recv_bytes(s, data + OFFSET, RANGE), tests[15].results[1],
+         "FAIL - Range did not start at the offset or has the wrong length");
+  if (fd >= 0) close(fd);
+  close_pair(l, c, s);
+}
+
+/* ----------------------------  Wire Header  -------------------------- */
+static void test_wire_header(void) {
+  int sock;
+  struct raw_peer p;
+  if (open_raw(&sock, &p) < 0) {
+    assert(0, tests[16].results[0], "FAIL - Could not connect to a raw peer");
+    return;
+  }
+
+  /* the seqnum is read byte by byte, so the check means the same on any host */
+  send_numbered(sock, 2);
+  int layout = HDR_LEN == 14;
+  for (int i = 0; i < 2; i++) {
+    rudp_packet_t pkt;
+    const uint8_t* b = (const uint8_t*)&pkt;
+    int n = raw_recv(&p, &pkt, 1000);
+    layout &= n == (int)HDR_LEN + PAYLOAD && b[0] == RUDP_VERSION && b[1] == DAT && b[4] == i &&
+              b[5] == 0 && b[6] == 0 && b[7] == 0 && memcmp(pkt.payload, &i, sizeof(i)) == 0;
+  }
+  assert(layout, tests[16].results[0], "FAIL - Header fields are not where the wire format puts them");
+
+  rudp_packet_t bad = { .version = RUDP_VERSION + 1, .type = DAT };
+  memcpy(bad.payload, "bad", 4);
+  sendto(p.fd, &bad, HDR_LEN + 4, 0, (struct sockaddr*)&p.addr, p.addrlen);
+  bad.version = RUDP_VERSION;
+  sendto(p.fd, &bad, HDR_LEN - 1, 0, (struct sockaddr*)&p.addr, p.addrlen);
+  rudp_packet_t good = { .version = RUDP_VERSION, .type = DAT };
+  memcpy(good.payload, "good", 5);
+  sendto(p.fd, &good, HDR_LEN + 5, 0, (struct sockaddr*)&p.addr, p.addrlen);
+
+  char buf[PKT_LEN];
+  struct timeval tv = { 1, 0 };
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  assert(sans_recv_pkt(sock, buf, sizeof(buf)) == 5 && strcmp(buf, "good") == 0, tests[16].results[1],
+         "FAIL - A malformed datagram was delivered in place of the valid one");
+  close_raw(sock, &p, 2);
+}
+
+/* --------------------------  Piggybacked ACK  ------------------------ */
+/* Send request `seq`, acknowledging the `seq` replies before it. */
+static void raw_request(struct raw_peer* p, uint32_t seq) {
+  rudp_packet_t request = {
+    .version = RUDP_VERSION,
+    .type = seq ? PIGGYBACK : DAT,
+    .seqnum = htole32(seq),
+    .ack = htole32(seq),
+    .wnd = htole16(UINT16_MAX),
+  };
+  memcpy(request.payload, "ping", 5);
+  sendto(p->fd, &request, HDR_LEN + 5, 0, (struct sockaddr*)&p->addr, p->addrlen);
+}
+
+/* have the socket read a request and answer it at once */
+static int ping(int sock, struct raw_peer* p, uint32_t seq) {
+  raw_request(p, seq);
+  char buf[PKT_LEN];
+  if (sans_recv_pkt(sock, buf, sizeof(buf)) != 5) return -1;
+  return sans_send_pkt(sock, "pong", 5);
+}
+
+/* The ACK is held for the longest delay allowed, so a prompt reply
+   usually finds it pending. When the delay ran out first (a slow host),
+   the ACK went out on its own ahead of the reply and the exchange is
+   repeated. */
+static void test_piggyback(void) {
+  enum { ATTEMPTS = 10 };
+  int sock;
+  struct raw_peer p;
+  if (open_raw(&sock, &p) < 0) {
+    assert(0, tests[17].results[0], "FAIL - Could not connect to a raw peer");
+    return;
+  }
+
+  struct sans_ack policy = { .every = 64, .delay_us = ACK_DELAY_MAX_US };
+  sans_setopt(sock, SANS_OPT_ACK, &policy, sizeof(policy));
+  struct timeval tv = { 1, 0 };
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+  uint32_t seq = 0;
+  int pending = 0, carried = 0;
+  unsigned long long acks = 0;
+  rudp_packet_t pkt;
+  struct sans_stats stats;
+  for (; seq < ATTEMPTS && !pending; seq++) {
+    if (sans_get_stats(sock, &stats) < 0 || ping(sock, &p, seq) < 0) break;
+    acks = stats.acks_sent;
+    /* skip resends of earlier replies too */
+    int ahead = 0, n;
+    while ((n = raw_recv(&p, &pkt, 1000)) >= (int)HDR_LEN && (pkt.type == ACK || le32toh(pkt.seqnum) != seq))
+      ahead |= pkt.type == ACK;
+    if (n < (int)HDR_LEN) break;
+    pending = !ahead;
+    carried = n == (int)HDR_LEN + 5 && pkt.type == PIGGYBACK && le32toh(pkt.seqnum) == seq &&
+              le32toh(pkt.ack) == seq + 1 && strcmp((char*)pkt.payload, "pong") == 0;
+  }
+  assert(pending && carried, tests[17].results[0], "FAIL - Reply did not acknowledge the request");
+
+  /* the reply may be resent meanwhile: an RTT sample makes the RTO short */
+  int extra = 0;
+  while (raw_recv(&p, &pkt, 20) >= 0) extra |= pkt.type == ACK;
+  assert(pending && carried && !extra && sans_get_stats(sock, &stats) == 0 && stats.acks_sent == acks,
+         tests[17].results[1], "FAIL - A pure ACK was sent for data a reply already acknowledged");
+
+  /* one more request acknowledges the last reply the same way */
+  char buf[PKT_LEN];
+  raw_request(&p, seq);
+  assert(pending && sans_recv_pkt(sock, buf, sizeof(buf)) == 5 && drained_stats(sock, &stats) == 0,
+         tests[17].results[2], "FAIL - Piggybacked ACK left the reply in the window");
+  close_raw(sock, &p, seq);
+}
+
+void t__p7_transport_tests(void) {
+  static void (*const run[])(void) = {
+    test_reorder,
+    test_bulk,
+    test_blocked_disconnect,
+    test_peers,
+    test_outlives_listener,
+    test_accept_close,
+    test_backlog_cap,
+    test_shared_sockbuf,
+    test_retransmit,
+    test_held_ack,
+    test_idle_peers,
+    test_blocked_reader,
+    test_sack,
+    test_rto,
+    test_fast_retransmit,
+    test_cc,
+    test_offload,
+    test_autotune,
+    test_duplicate,
+    test_shaping,
+    test_stats_scripted,
+    test_stats_lossy,
+    test_trace,
+    test_zc_acked,
+    test_zc_cut,
+    test_send_file,
+    test_wire_header,
+    test_piggyback,
+  };
+
+  s__initialize_tests(tests, sizeof(tests) / sizeof(tests[0]));
+  for (int i = 0; i < S_MAX_REF; i++)
+    s__analytics[i].precall = NULL;
+  /* each test gets the harness's whole budget, so a hang is still caught */
+  for (size_t i = 0; i < sizeof(run) / sizeof(run[0]); i++) {
+    alarm(9);
+    run[i]();
+  }
+}
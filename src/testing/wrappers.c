@@ -328,7 +328,10 @@ int __wrap_main(int argc, char** argv) {
   t__p6_tests();
 #elif PROJECT == 7 
   void t__p7_tests(void);
+  void t__p7_transport_tests(void);
   t__p7_tests();
+  s__print_results();
+  t__p7_transport_tests();
 #elif PROJECT == 8
   void t__p8_tests(void);
   t__p8_tests();